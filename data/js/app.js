@@ -15,7 +15,14 @@ ws.onmessage = function (evt) {
   if (evt.data != null) {
     var data = JSON.parse(evt.data);
     if (data == null) return;
-    updateFieldValue(data.name, data.value);
+    // scene recalls and batch updates arrive as one array
+    if (Array.isArray(data)) {
+      $.each(data, function (index, field) {
+        updateFieldValue(field.name, field.value);
+      });
+    } else {
+      updateFieldValue(data.name, data.value);
+    }
   }
 }
 
@@ -0,0 +1,97 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Render depth of leds[], the buffer the blend stages (transitions, segment
+// brightness) write and the output stage reads. Patterns always draw 8-bit
+// CRGB. With -D RENDER_DEPTH_16 the blend stages keep 16 bits per channel and
+// output.h applies gamma and brightness at that depth before a temporally
+// dithered downconvert, so low brightness fades don't band.
+
+#ifdef RENDER_DEPTH_16
+
+struct CRGB16
+{
+  uint16_t r;
+  uint16_t g;
+  uint16_t b;
+};
+
+typedef CRGB16 RenderPixel;
+
+inline void storePixel(RenderPixel &out, const CRGB &color)
+{
+  // * 257 maps 0-255 onto the full 0-65535
+  out.r = color.r * 257;
+  out.g = color.g * 257;
+  out.b = color.b * 257;
+}
+
+inline void storeBlend(RenderPixel &out, const CRGB &from, const CRGB &to, uint8_t amount)
+{
+  // amount 0-255 stretched to 0-256 so that 255 is all `to`
+  uint16_t a = amount + (amount >> 7);
+  out.r = (from.r * 257 * (256 - a) + to.r * 257 * a) >> 8;
+  out.g = (from.g * 257 * (256 - a) + to.g * 257 * a) >> 8;
+  out.b = (from.b * 257 * (256 - a) + to.b * 257 * a) >> 8;
+}
+
+inline void storeScaled(RenderPixel &out, const CRGB &color, uint8_t scale)
+{
+  uint16_t s = scale + 1;
+  out.r = (color.r * 257 * s) >> 8;
+  out.g = (color.g * 257 * s) >> 8;
+  out.b = (color.b * 257 * s) >> 8;
+}
+
+inline void clearPixels(RenderPixel *pixels, uint16_t count)
+{
+  memset(pixels, 0, count * sizeof(RenderPixel));
+}
+
+#else
+
+typedef CRGB RenderPixel;
+
+inline void storePixel(RenderPixel &out, const CRGB &color)
+{
+  out = color;
+}
+
+inline void storeBlend(RenderPixel &out, const CRGB &from, const CRGB &to, uint8_t amount)
+{
+  out = blend(from, to, amount);
+}
+
+inline void storeScaled(RenderPixel &out, const CRGB &color, uint8_t scale)
+{
+  out = color;
+  out.nscale8_video(scale);
+}
+
+inline void clearPixels(RenderPixel *pixels, uint16_t count)
+{
+  fill_solid(pixels, count, CRGB::Black);
+}
+
+#endif
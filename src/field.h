@@ -22,212 +22,491 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-typedef String (*FieldSetter)(String);
-typedef String (*FieldGetter)();
+typedef void (*FieldHook)();
+typedef void (*FieldOptions)(String &json);
 
-const String NumberFieldType = "Number";
-const String BooleanFieldType = "Boolean";
-const String SelectFieldType = "Select";
-const String ColorFieldType = "Color";
-const String SectionFieldType = "Section";
+enum FieldType : uint8_t
+{
+  NumberFieldType,
+  BooleanFieldType,
+  SelectFieldType,
+  ColorFieldType,
+  SectionFieldType,
+};
+
+const char *fieldTypeName(FieldType type)
+{
+  switch (type)
+  {
+  case NumberFieldType:
+    return "Number";
+  case BooleanFieldType:
+    return "Boolean";
+  case SelectFieldType:
+    return "Select";
+  case ColorFieldType:
+    return "Color";
+  case SectionFieldType:
+    return "Section";
+  }
+  return "";
+}
 
-typedef struct Field
+// Field descriptors are constexpr so the whole table, names and labels
+// included, lives in flash instead of being copied into DRAM at boot.
+// Each field is bound straight to the variable it controls: `value` for
+// Number/Boolean/Select fields, `color` for Color fields. Writes are clamped
+// to [min, max] and then `onChange` runs, if the field needs a side effect.
+struct Field
 {
-public:
-  String name;
-  String label;
-  String type;
+  const char *name;
+  const char *label;
+  FieldType type;
   uint8_t min;
   uint8_t max;
-  FieldGetter getValue;
-  FieldGetter getOptions;
-  FieldSetter setValue;
+  uint8_t *value;
+  CRGB *color;
+  FieldOptions getOptions;
+  FieldHook onChange;
 };
 
-typedef Field FieldList[];
+// Name lookup goes through a perfect hash: a seed is searched for at compile
+// time so that every field name lands in its own slot, which makes a lookup
+// one hash, one table load and one strcmp to reject unknown names.
+#define FIELD_INDEX_BITS 7
+#define FIELD_INDEX_SIZE (1 << FIELD_INDEX_BITS)
+#define FIELD_INDEX_MASK (FIELD_INDEX_SIZE - 1)
+#define FIELD_INDEX_EMPTY 0xFF
+#define FIELD_INDEX_MAX_SEED 4096
 
-Field getField(String name, FieldList fields, uint8_t count)
+constexpr uint32_t fieldNameHash(const char *name, uint32_t seed)
 {
-  for (uint8_t i = 0; i < count; i++)
+  // FNV-1a, with the seed folded into the offset basis
+  uint32_t hash = 2166136261u ^ seed;
+  while (*name)
   {
-    Field field = fields[i];
-    if (field.name == name)
-    {
-      return field;
-    }
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
   }
-  return Field();
+  return hash;
 }
 
-String getFieldValue(String name, FieldList fields, uint8_t count)
+// same hash for a name that isn't null terminated, e.g. inside a request body
+constexpr uint32_t fieldNameHash(const char *name, size_t length, uint32_t seed)
 {
-  Field field = getField(name, fields, count);
-  if (field.getValue)
+  uint32_t hash = 2166136261u ^ seed;
+  while (length--)
   {
-    return field.getValue();
+    hash ^= (uint8_t)*name++;
+    hash *= 16777619u;
   }
-  return String();
+  return hash;
+}
+
+// Index slot for a name hashed with seed 0. The seed goes through murmur3's
+// fmix32 finalizer with the hash, so every seed gives a fresh spread over
+// the slots, not just the ones that differ in the low FIELD_INDEX_BITS.
+constexpr uint8_t fieldIndexSlot(uint32_t hash, uint32_t seed)
+{
+  hash ^= seed * 0x9E3779B9u;
+  hash ^= hash >> 16;
+  hash *= 0x85EBCA6Bu;
+  hash ^= hash >> 13;
+  hash *= 0xC2B2AE35u;
+  hash ^= hash >> 16;
+  return hash & FIELD_INDEX_MASK;
 }
 
-CRGB parseColor(String value)
+struct FieldIndex
 {
-  uint8_t ri = value.indexOf(",");
-  uint8_t gi = value.indexOf(",", ri + 1);
+  uint32_t seed;
+  uint8_t slots[FIELD_INDEX_SIZE];
+};
+
+template <size_t N>
+constexpr bool fieldIndexIsPerfect(const Field (&fields)[N], uint32_t seed)
+{
+  bool used[FIELD_INDEX_SIZE] = {};
+  for (size_t i = 0; i < N; i++)
+  {
+    uint8_t slot = fieldIndexSlot(fieldNameHash(fields[i].name, 0), seed);
+    if (used[slot])
+      return false;
+    used[slot] = true;
+  }
+  return true;
+}
 
-  String rs = value.substring(0, ri);
-  String gs = value.substring(ri + 1, gi);
-  String bs = value.substring(gi + 1);
+template <size_t N>
+constexpr FieldIndex makeFieldIndex(const Field (&fields)[N])
+{
+  FieldIndex index = {};
+  index.seed = 0;
+  while (index.seed < FIELD_INDEX_MAX_SEED && !fieldIndexIsPerfect(fields, index.seed))
+    index.seed++;
 
-  uint8_t r = rs.toInt();
-  uint8_t g = gs.toInt();
-  uint8_t b = bs.toInt();
+  for (size_t i = 0; i < FIELD_INDEX_SIZE; i++)
+    index.slots[i] = FIELD_INDEX_EMPTY;
+  for (size_t i = 0; i < N; i++)
+    index.slots[fieldIndexSlot(fieldNameHash(fields[i].name, 0), index.seed)] = i;
 
-  return CRGB(r, g, b);
+  return index;
 }
 
-void writeFieldsToEEPROM(FieldList fields, uint8_t count)
+struct FieldTable
 {
-  uint8_t index = 0;
+  const Field *fields;
+  uint8_t count;
+  FieldIndex index;
+};
 
-  EEPROM.write(index, 0);
+template <size_t N>
+constexpr FieldTable makeFieldTable(const Field (&fields)[N])
+{
+  static_assert(N < FIELD_INDEX_EMPTY, "too many fields for the field index");
+  return FieldTable{fields, N, makeFieldIndex(fields)};
+}
 
-  for (uint8_t i = 0; i < count; i++)
-  {
-    Field field = fields[i];
-    if (!field.getValue && !field.setValue)
-      continue;
+const Field *getField(const char *name, const FieldTable &table)
+{
+  uint8_t slot = table.index.slots[fieldIndexSlot(fieldNameHash(name, 0), table.index.seed)];
+  if (slot == FIELD_INDEX_EMPTY)
+    return nullptr;
 
-    String value = field.getValue();
+  const Field *field = &table.fields[slot];
+  if (strcmp(field->name, name) != 0)
+    return nullptr;
 
-    if (field.type == ColorFieldType)
-    {
-      CRGB color = parseColor(value);
-      EEPROM.write(index++, color.r);
-      EEPROM.write(index++, color.g);
-      EEPROM.write(index++, color.b);
-    }
-    else
-    {
-      byte v = value.toInt();
-      EEPROM.write(index++, v);
-    }
-  }
+  return field;
+}
+
+const Field *getField(const char *name, size_t length, const FieldTable &table)
+{
+  uint8_t slot = table.index.slots[fieldIndexSlot(fieldNameHash(name, length, 0), table.index.seed)];
+  if (slot == FIELD_INDEX_EMPTY)
+    return nullptr;
+
+  const Field *field = &table.fields[slot];
+  if (strncmp(field->name, name, length) != 0 || field->name[length] != 0)
+    return nullptr;
 
-  EEPROM.commit();
+  return field;
 }
 
-String setFieldValue(String name, String value, FieldList fields, uint8_t count, boolean persist = true)
+// Longest formatted value is a color, "255,255,255"
+#define FIELD_VALUE_MAX_LENGTH 12
+
+// Everything below is the one place field values are converted to and from
+// text (HTTP, WebSocket JSON) and bytes (settings records).
+
+size_t formatFieldValue(const Field &field, char *buffer, size_t length)
 {
-  Field field = getField(name, fields, count);
-  if (!field.setValue) {
-    return "";
-  }
-  String result = field.setValue(value);
-  // updateOtherClients(); // broadcast esp now as some global state got updated
+  if (field.color)
+    return snprintf(buffer, length, "%u,%u,%u", field.color->r, field.color->g, field.color->b);
+  if (field.value)
+    return snprintf(buffer, length, "%u", *field.value);
 
-  String json = "{\"name\":\"" + name + "\",\"value\":" + result + "}";
-  webSocketsServer.broadcastTXT(json);
+  buffer[0] = 0;
+  return 0;
+}
 
-  if (persist) {
-    writeFieldsToEEPROM(fields, count);
+// colors are JSON strings, everything else is a bare number
+void appendFieldValueJson(String &json, const Field &field)
+{
+  char value[FIELD_VALUE_MAX_LENGTH];
+  formatFieldValue(field, value, sizeof(value));
+
+  if (field.color)
+    json += '"';
+  json += value;
+  if (field.color)
+    json += '"';
+}
+
+void writeFieldValue(const Field &field, uint8_t value)
+{
+  if (!field.value)
+    return;
+
+  *field.value = constrain(value, field.min, field.max);
+
+  if (field.onChange)
+    field.onChange();
+}
+
+void writeFieldColor(const Field &field, CRGB color)
+{
+  if (!field.color)
+    return;
+
+  *field.color = color;
+
+  if (field.onChange)
+    field.onChange();
+}
+
+uint8_t fieldBinarySize(const Field &field)
+{
+  if (field.color)
+    return 3;
+  if (field.value)
+    return 1;
+  return 0;
+}
+
+uint8_t writeFieldBinary(const Field &field, uint8_t *out)
+{
+  if (field.color)
+  {
+    out[0] = field.color->r;
+    out[1] = field.color->g;
+    out[2] = field.color->b;
+  }
+  else if (field.value)
+  {
+    out[0] = *field.value;
   }
+  return fieldBinarySize(field);
+}
 
-  return result;
+uint8_t readFieldBinary(const Field &field, const uint8_t *in)
+{
+  if (field.color)
+  {
+    writeFieldColor(field, CRGB(in[0], in[1], in[2]));
+  }
+  else if (field.value)
+  {
+    writeFieldValue(field, in[0]);
+  }
+  return fieldBinarySize(field);
+}
+
+// Tagged binary form, for values that outlive the firmware that wrote them:
+// per field a 16-bit tag of its name, the value size, then the value.
+// Readers match by tag, so fields can be added, removed or reordered
+// without losing the values of the others.
+#define FIELD_TAG_HEADER_SIZE 3
+
+constexpr uint16_t fieldTag(const char *name)
+{
+  uint32_t hash = fieldNameHash(name, 0);
+  return (hash >> 16) ^ (hash & 0xFFFF);
 }
 
-void loadFieldsFromEEPROM(FieldList fields, uint8_t count)
+template <size_t N>
+constexpr bool fieldTagsAreUnique(const Field (&fields)[N])
 {
-  uint8_t byteCount = 1;
+  for (size_t i = 0; i < N; i++)
+    for (size_t j = i + 1; j < N; j++)
+      if (fieldTag(fields[i].name) == fieldTag(fields[j].name))
+        return false;
+  return true;
+}
 
-  for (uint8_t i = 0; i < count; i++)
+uint16_t writeFieldsTagged(const FieldTable &table, uint8_t *out, uint16_t capacity)
+{
+  uint16_t length = 0;
+  for (uint8_t i = 0; i < table.count; i++)
   {
-    Field field = fields[i];
-    if (!field.setValue)
+    const Field &field = table.fields[i];
+    uint8_t size = fieldBinarySize(field);
+    if (size == 0)
       continue;
+    if (length + FIELD_TAG_HEADER_SIZE + size > capacity)
+      break;
+    uint16_t tag = fieldTag(field.name);
+    out[length] = tag & 0xFF;
+    out[length + 1] = tag >> 8;
+    out[length + 2] = size;
+    length += FIELD_TAG_HEADER_SIZE;
+    length += writeFieldBinary(field, out + length);
+  }
+  return length;
+}
 
-    if (field.type == ColorFieldType)
-    {
-      byteCount += 3;
-    }
-    else
+// Calls apply(field, bytes) for every value in a tagged payload whose tag
+// and size match a field of table. Values for unknown fields, or for fields
+// that changed size, are skipped. Returns the number of values applied.
+template <typename Apply>
+uint8_t forEachTaggedField(const FieldTable &table, const uint8_t *in, uint16_t length, Apply apply)
+{
+  uint8_t applied = 0;
+  uint16_t offset = 0;
+  while (offset + FIELD_TAG_HEADER_SIZE <= length)
+  {
+    uint16_t tag = in[offset] | (in[offset + 1] << 8);
+    uint8_t size = in[offset + 2];
+    offset += FIELD_TAG_HEADER_SIZE;
+    if (offset + size > length)
+      break;
+
+    for (uint8_t i = 0; i < table.count; i++)
     {
-      byteCount++;
+      const Field &field = table.fields[i];
+      if (fieldTag(field.name) == tag && fieldBinarySize(field) == size)
+      {
+        apply(field, in + offset);
+        applied++;
+        break;
+      }
     }
+    offset += size;
   }
+  return applied;
+}
+
+// metrics.h
+void countWebSocketBroadcast();
+
+void broadcastFieldValue(const Field &field)
+{
+  // {"name":"<name>","value":"<r,g,b>"}
+  char json[32 + FIELD_VALUE_MAX_LENGTH + 32];
+  char value[FIELD_VALUE_MAX_LENGTH];
+  formatFieldValue(field, value, sizeof(value));
 
-  EEPROM.begin(count);
-  // if () {
-  //   Serial.println("Failed to initialize EEPROM!");
-  //   return;
-  // }
+  const char *quote = field.color ? "\"" : "";
+  snprintf(json, sizeof(json), "{\"name\":\"%s\",\"value\":%s%s%s}", field.name, quote, value, quote);
+  webSocketsServer.broadcastTXT(json);
+  countWebSocketBroadcast();
+}
 
-  if (EEPROM.read(0) == 255)
+// Parses the decimal number at text, stopping at end. Anything past 255
+// saturates, and if there are no digits at all `next` is left at text.
+long parseFieldNumber(const char *text, const char *end, const char **next)
+{
+  const char *p = text;
+  bool negative = p < end && *p == '-';
+  if (negative)
+    p++;
+
+  const char *digits = p;
+  long value = 0;
+  while (p < end && *p >= '0' && *p <= '9')
   {
-    Serial.println("First run, or EEPROM erased, skipping settings load!");
-    return;
+    if (value < 1000)
+      value = value * 10 + (*p - '0');
+    p++;
   }
 
-  uint8_t index = 0;
+  *next = p == digits ? text : p;
+  return negative ? -value : value;
+}
 
-  for (uint8_t i = 0; i < count; i++)
-  {
-    Field field = fields[i];
-    if (!field.setValue)
-      continue;
+// Parses text (not necessarily null terminated) into the binary form of
+// the field, clamped to its range: "42" for numbers, "r,g,b" for colors.
+// Returns the size written, 0 if text isn't a value of that form.
+uint8_t parseFieldBinary(const Field &field, const char *text, const char *end, uint8_t *out)
+{
+  const char *next = text;
 
-    if (field.type == ColorFieldType)
-    {
-      String r = String(EEPROM.read(index++));
-      String g = String(EEPROM.read(index++));
-      String b = String(EEPROM.read(index++));
-      field.setValue(r + "," + g + "," + b);
-    }
-    else
+  if (field.color)
+  {
+    for (uint8_t c = 0; c < 3; c++)
     {
-      byte v = EEPROM.read(index++);
-      field.setValue(String(v));
+      const char *component = next;
+      long value = parseFieldNumber(component, end, &next);
+      if (next == component)
+        return 0;
+      out[c] = constrain(value, 0, 255);
+      if (c < 2)
+      {
+        if (next >= end || *next != ',')
+          return 0;
+        next++;
+      }
     }
+    return 3;
+  }
+
+  if (field.value)
+  {
+    long value = parseFieldNumber(next, end, &next);
+    if (next == text)
+      return 0;
+    out[0] = constrain(value, field.min, field.max);
+    return 1;
   }
+
+  return 0;
+}
+
+bool parseFieldValue(const Field &field, const char *text)
+{
+  uint8_t bytes[3];
+  if (!parseFieldBinary(field, text, text + strlen(text), bytes)) {
+    return false;
+  }
+
+  readFieldBinary(field, bytes);
+  return true;
 }
 
-String getFieldsJson(FieldList fields, uint8_t count)
+// settings.h; commits are debounced so dragging a slider doesn't erase flash
+void markSettingsDirty();
+
+// call after a field was written so other clients and flash catch up
+void fieldValueChanged(const Field &field, boolean persist = true)
+{
+  // updateOtherClients(); // broadcast esp now as some global state got updated
+  broadcastFieldValue(field);
+
+  if (persist) {
+    markSettingsDirty();
+  }
+}
+
+bool setFieldValue(const Field &field, const char *value, boolean persist = true)
+{
+  if (!parseFieldValue(field, value)) {
+    return false;
+  }
+
+  fieldValueChanged(field, persist);
+  return true;
+}
+
+String getFieldsJson(const FieldTable &table)
 {
   String json = "[";
 
-  for (uint8_t i = 0; i < count; i++)
+  for (uint8_t i = 0; i < table.count; i++)
   {
-    Field field = fields[i];
+    const Field &field = table.fields[i];
 
-    json += "{\"name\":\"" + field.name + "\",\"label\":\"" + field.label + "\",\"type\":\"" + field.type + "\"";
+    json += "{\"name\":\"";
+    json += field.name;
+    json += "\",\"label\":\"";
+    json += field.label;
+    json += "\",\"type\":\"";
+    json += fieldTypeName(field.type);
+    json += "\"";
 
-    if (field.getValue)
+    if (field.value || field.color)
     {
-      if (field.type == ColorFieldType || field.type == "String")
-      {
-        json += ",\"value\":\"" + field.getValue() + "\"";
-      }
-      else
-      {
-        json += ",\"value\":" + field.getValue();
-      }
+      json += ",\"value\":";
+      appendFieldValueJson(json, field);
     }
 
     if (field.type == NumberFieldType)
     {
-      json += ",\"min\":" + String(field.min);
-      json += ",\"max\":" + String(field.max);
+      json += ",\"min\":";
+      json += field.min;
+      json += ",\"max\":";
+      json += field.max;
     }
 
     if (field.getOptions)
     {
       json += ",\"options\":[";
-      json += field.getOptions();
+      field.getOptions(json);
       json += "]";
     }
 
     json += "}";
 
-    if (i < count - 1)
+    if (i < table.count - 1)
       json += ",";
   }
 
@@ -22,275 +22,137 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-String getPower() {
-  return String(power);
-}
-
-String setPower(String value) {
-  power = value.toInt();
-  power = power == 0 ? 0 : 1;
-  return String(power);
-}
-
-String getBrightness() {
-  return String(brightness);
-}
-
-String setBrightness(String value) {
-  brightness = value.toInt();
-  FastLED.setBrightness(brightness);
-  return String(brightness);
-}
-
-String getMaxPower() {
-  return String(gMaxPower);
-}
-
-String setMaxPower(String value) {
-  gMaxPower = value.toInt();
-  FastLED.setMaxPowerInVoltsAndMilliamps(5, MAX_POWER_CONVERSION);
-  return String(gMaxPower);
-}
-
-String getPattern() {
-  return String(currentPatternIndex);
-}
-
-void setPattern(uint8_t value)
-{
-  if (value >= patternCount)
-    value = patternCount - 1;
-
-  currentPatternIndex = value;
+void autoplayChanged() {
+  autoPlayTimeout = millis() + (autoplayDuration * 1000);
 }
 
-String setPattern(String value) {
-  setPattern(value.toInt());
-  return String(currentPatternIndex);
+void cyclePalettesChanged() {
+  paletteTimeout = millis() + (paletteDuration * 1000);
 }
 
-String getPatterns() {
-  String json = "";
-
+void getPatterns(String &json) {
   for (uint8_t i = 0; i < patternCount; i++) {
-    json += "\"" + patterns[i].name + "\"";
+    json += "\"";
+    json += patterns[i].name;
+    json += "\"";
     if (i < patternCount - 1)
       json += ",";
   }
-
-  return json;
-}
-
-String getPalette() {
-  return String(currentPaletteIndex);
-}
-
-String setPalette(String value) {
-  // value.toInt() returns long, while currentPaletteIndex is declared as uint8_t
-  long tmp = value.toInt();
-  // clamp to [0.. paletteCount-1]
-  if (tmp < 1) {
-    tmp = 1;
-  } else if (tmp > (paletteCount-1)) {
-    tmp = paletteCount-1;
-  }
-  currentPaletteIndex = tmp;
-  targetPalette = palettes[currentPaletteIndex];
-  return String(currentPaletteIndex);
 }
 
-String getPalettes() {
-  String json = "";
-
+void getPalettes(String &json) {
   for (uint8_t i = 0; i < paletteCount; i++) {
-    json += "\"" + paletteNames[i] + "\"";
+    json += "\"";
+    json += paletteSources[i].name;
+    json += "\"";
     if (i < paletteCount - 1)
       json += ",";
   }
-
-  return json;
-}
-
-String getSpeed() {
-  return String(speed);
-}
-
-String setSpeed(String value) {
-  speed = value.toInt();
-  return String(speed);
-}
-
-String getAutoplay() {
-  return String(autoplay);
-}
-
-String setAutoplay(String value) {
-  autoplay = value.toInt();
-  autoplay = autoplay == 0 ? 0 : 1;
-  autoPlayTimeout = millis() + (autoplayDuration * 1000);
-  return String(autoplay);
-}
-
-String getMirrored() {
-  return String(mirrored);
 }
 
-String setMirrored(String value) {
-  mirrored = value.toInt();
-  mirrored = mirrored == 0 ? 0 : 1;
-  return String(mirrored);
-}
-
-String getAutoplayDuration() {
-  return String(autoplayDuration);
-}
-
-String setAutoplayDuration(String value) {
-  // value.toInt() returns long, while autoplayDuration is declared as uint8_t
-  long tmp = value.toInt();
-  // clamp to [1..255]
-  if (tmp < 1) {
-    tmp = 1;
-  } else if (tmp > 255) {
-    tmp = 255;
+void getTransitions(String &json) {
+  for (uint8_t i = 0; i < transitionCount; i++) {
+    json += "\"";
+    json += transitionNames[i];
+    json += "\"";
+    if (i < transitionCount - 1)
+      json += ",";
   }
-  autoplayDuration = tmp;
-  autoPlayTimeout = millis() + (tmp * 1000);
-  return String(autoplayDuration);
-}
-
-String getCyclePalettes() {
-  return String(cyclePalettes);
-}
-
-String setCyclePalettes(String value) {
-  cyclePalettes = value.toInt();
-  cyclePalettes = cyclePalettes == 0 ? 0 : 1;
-  paletteTimeout = millis() + (paletteDuration * 1000);
-  return String(cyclePalettes);
 }
 
-String getPaletteDuration() {
-  return String(paletteDuration);
-}
-
-String setPaletteDuration(String value) {
-  // value.toInt() returns long, while paletteDuration is declared as uint8_t
-  long tmp = value.toInt();
-  // clamp to [1..255]
-  if (tmp < 1) {
-    tmp = 1;
-  } else if (tmp > 255) {
-    tmp = 255;
+void getSegments(String &json) {
+  for (uint8_t i = 0; i < SEGMENT_MAX; i++) {
+    json += "\"Segment ";
+    json += i + 1;
+    json += "\"";
+    if (i < SEGMENT_MAX - 1)
+      json += ",";
   }
-  paletteDuration = tmp;
-  paletteTimeout = millis() + (tmp * 1000);
-  return String(paletteDuration);
-}
-
-String getSolidColor() {
-  return String(solidColor.r) + "," + String(solidColor.g) + "," + String(solidColor.b);
-}
-
-String setSolidColor(uint8_t r, uint8_t g, uint8_t b)
-{
-  solidColor = CRGB(r, g, b);
-
-  return "\"" + String(solidColor.r) + "," + String(solidColor.g) + "," + String(solidColor.b) + "\"";
 }
 
-String setSolidColor(CRGB color) {
-  return setSolidColor(color.r, color.g, color.b);
-}
-
-String setSolidColor(String value) {
-  CRGB color = parseColor(value);
-  
-  return setSolidColor(color);
-}
-
-String getCooling() {
-  return String(cooling);
-}
+void segmentCountChanged() {
+  segmentsDirty = true;
+}
+
+void segmentChanged() {
+  sanitizeSegment(segmentEdit);
+  segments[selectedSegment] = segmentEdit;
+  segmentsDirty = true;
+}
+
+// loads the newly selected segment into the segment* fields, below the table
+void selectedSegmentChanged();
+
+constexpr Field fields[] = {
+  // name                 label                type               min,            max,  value,                 color,        getOptions,   onChange
+  { "power",              "Power",             BooleanFieldType,    0,              1,  &power,                NULL,         NULL,         powerChanged         },
+  { "brightness",         "Brightness",        NumberFieldType,     1,            255,  &brightness,           NULL,         NULL,         NULL                 },
+  { "speed",              "Speed",             NumberFieldType,     1,            255,  &speed,                NULL,         NULL,         NULL                 },
+
+  { "patternSection",     "Pattern",           SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "pattern",            "Pattern",           SelectFieldType,     0, patternCount-1,  &currentPatternIndex,  NULL,         getPatterns,  NULL                 },
+  { "autoplay",           "Cycle Patterns",    BooleanFieldType,    0,              1,  &autoplay,             NULL,         NULL,         autoplayChanged      },
+  { "autoplayDuration",   "Pattern Duration",  NumberFieldType,     1,            255,  &autoplayDuration,     NULL,         NULL,         autoplayChanged      },
+  { "transition",         "Transition",        SelectFieldType,     0, transitionCount-1, &transitionType,     NULL,         getTransitions, NULL               },
+  { "transitionDuration", "Fade Time (x0.1s)", NumberFieldType,     0,             50,  &transitionDuration,   NULL,         NULL,         NULL                 },
+
+  { "paletteSection",     "Palette",           SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "palette",            "Palette",           SelectFieldType,     0, paletteCount-1,  &currentPaletteIndex,  NULL,         getPalettes,  NULL                 },
+  { "cyclePalettes",      "Cycle Palettes",    BooleanFieldType,    0,              1,  &cyclePalettes,        NULL,         NULL,         cyclePalettesChanged },
+  { "paletteDuration",    "Palette Duration",  NumberFieldType,     1,            255,  &paletteDuration,      NULL,         NULL,         cyclePalettesChanged },
+
+  { "solidColorSection",  "Solid Color",       SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "solidColor",         "Color",             ColorFieldType,      0,            255,  NULL,                  &solidColor,  NULL,         NULL                 },
+
+  { "fire",               "Fire & Water",      SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "cooling",            "Cooling",           NumberFieldType,     0,            255,  &cooling,              NULL,         NULL,         NULL                 },
+  { "sparking",           "Sparking",          NumberFieldType,     0,            255,  &sparking,             NULL,         NULL,         NULL                 },
+  { "flames",             "Flames",            NumberFieldType,     1,     FLAMES_MAX,  &flames,               NULL,         NULL,         NULL                 },
+
+  { "twinklesSection",    "Twinkles",          SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "twinkleSpeed",       "Twinkle Speed",     NumberFieldType,     0,              8,  &twinkleSpeed,         NULL,         NULL,         NULL                 },
+  { "twinkleDensity",     "Twinkle Density",   NumberFieldType,     0,              8,  &twinkleDensity,       NULL,         NULL,         NULL                 },
+
+  { "displayDesction",    "Display Params",    SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "mirrored",           "Mirror LEDS",       BooleanFieldType,    0,              1,  &mirrored,             NULL,         NULL,         outputStageChanged   },
+  { "outputOffset",       "LED Offset",        NumberFieldType,     0, OUTPUT_OFFSET_MAX,  &outputOffset,       NULL,         NULL,         outputStageChanged   },
+  { "outputInterleave",   "LED Interleave",    NumberFieldType,     1, OUTPUT_INTERLEAVE_MAX, &outputInterleave, NULL,       NULL,         outputStageChanged   },
+  { "gamma",              "Gamma (x0.1)",      NumberFieldType,    10,             30,  &outputGamma,          NULL,         NULL,         outputStageChanged   },
+  { "localWhiteBalance",  "White Balance",     ColorFieldType,      0,            255,  NULL,                  &localWhiteBalance, NULL,   outputStageChanged   },
+  { "remoteWhiteBalance", "Remote White Balance", ColorFieldType, 0,            255,  NULL,                  &remoteWhiteBalance, NULL,  outputStageChanged   },
+  { "maxPower",           "Max POWER (x20w)",  NumberFieldType,     0,            255,  &gMaxPower,            NULL,         NULL,         NULL                 },
+  { "stationMode",        "Join WiFi Network", BooleanFieldType,    0,              1,  &stationMode,          NULL,         NULL,         wifiModeChanged      },
+
+  { "segmentSection",     "Segments",          SectionFieldType,    0,              0,  NULL,                  NULL,         NULL,         NULL                 },
+  { "segmentCount",       "Segments (0 = off)",NumberFieldType,     0,    SEGMENT_MAX,  &segmentCount,         NULL,         NULL,         segmentCountChanged  },
+  { "segment",            "Edit Segment",      SelectFieldType,     0,  SEGMENT_MAX-1,  &selectedSegment,      NULL,         getSegments,  selectedSegmentChanged },
+  { "segmentStart",       "Start",             NumberFieldType,     0,  SEGMENT_UNITS,  &segmentEdit.start,    NULL,         NULL,         segmentChanged       },
+  { "segmentLength",      "Length",            NumberFieldType,     0,  SEGMENT_UNITS,  &segmentEdit.length,   NULL,         NULL,         segmentChanged       },
+  { "segmentPattern",     "Pattern",           SelectFieldType,     0, patternCount-1,  &segmentEdit.pattern,  NULL,         getPatterns,  segmentChanged       },
+  { "segmentPalette",     "Palette",           SelectFieldType,     0, paletteCount-1,  &segmentEdit.palette,  NULL,         getPalettes,  segmentChanged       },
+  { "segmentSpeed",       "Speed",             NumberFieldType,     1,            255,  &segmentEdit.speed,    NULL,         NULL,         segmentChanged       },
+  { "segmentBrightness",  "Brightness",        NumberFieldType,     0,            255,  &segmentEdit.brightness, NULL,       NULL,         segmentChanged       },
+};
 
-String setCooling(String value) {
-  cooling = value.toInt();
-  return String(cooling);
-}
+constexpr uint8_t fieldCount = ARRAY_SIZE(fields);
 
-String getSparking() {
-  return String(sparking);
-}
-
-String setSparking(String value) {
-  sparking = value.toInt();
-  return String(sparking);
-}
+constexpr FieldTable fieldTable = makeFieldTable(fields);
+static_assert(fieldTable.index.seed < FIELD_INDEX_MAX_SEED, "no perfect hash seed found for field names");
+static_assert(fieldTagsAreUnique(fields), "two field names share a tag, rename one");
 
-String getTwinkleSpeed() {
-  return String(twinkleSpeed);
-}
-
-String setTwinkleSpeed(String value) {
-  // value.toInt() returns long, while twinkleSpeed is declared as uint8_t
-  long tmp = value.toInt();
-  // clamp to [0..8]
-  if (tmp < 0) {
-    tmp = 0;
-  } else if (tmp > 8) {
-    tmp = 8;
-  }
-  twinkleSpeed = tmp;
-  return String(twinkleSpeed);
+// Fields that configure the device rather than the look. Scenes and
+// /fieldValues batches leave them alone, so recalling a preset can't take
+// the skate off its network.
+bool isDeviceField(const Field &field)
+{
+  return field.value == &stationMode;
 }
 
-String getTwinkleDensity() {
-  return String(twinkleDensity);
-}
+void selectedSegmentChanged() {
+  segmentEdit = segments[selectedSegment];
 
-String setTwinkleDensity(String value) {
-  // value.toInt() returns long, while twinkleDensity is declared as uint8_t
-  long tmp = value.toInt();
-  // clamp to [0..8]
-  if (tmp < 0) {
-    tmp = 0;
-  } else if (tmp > 8) {
-    tmp = 8;
+  const char *names[] = { "segmentStart", "segmentLength", "segmentPattern", "segmentPalette", "segmentSpeed", "segmentBrightness" };
+  for (uint8_t i = 0; i < ARRAY_SIZE(names); i++) {
+    broadcastFieldValue(*getField(names[i], fieldTable));
   }
-  twinkleDensity = tmp;
-  return String(twinkleDensity);
 }
-
-FieldList fields = {
-  // name                 label                type               min,          max,  getValue,            getOptions,   setValue
-  { "power",              "Power",             BooleanFieldType,    0,            1,  getPower,            NULL,         setPower            },
-  { "brightness",         "Brightness",        NumberFieldType,     1,          255,  getBrightness,       NULL,         setBrightness       },
-  { "speed",              "Speed",             NumberFieldType,     1,          255,  getSpeed,            NULL,         setSpeed            },
-  
-  { "patternSection",     "Pattern",           SectionFieldType,    0,            0,  NULL,                NULL,         NULL                },
-  { "pattern",            "Pattern",           SelectFieldType,     0, patternCount,  getPattern,          getPatterns,  setPattern          },
-  { "autoplay",           "Cycle Patterns",    BooleanFieldType,    0,            1,  getAutoplay,         NULL,         setAutoplay         },
-  { "autoplayDuration",   "Pattern Duration",  NumberFieldType,     1,          255,  getAutoplayDuration, NULL,         setAutoplayDuration },
-  
-  { "paletteSection",     "Palette",           SectionFieldType,    0,            0,  NULL,                NULL,         NULL                },
-  { "palette",            "Palette",           SelectFieldType,     0, paletteCount,  getPalette,          getPalettes,  setPalette          },
-  { "cyclePalettes",      "Cycle Palettes",    BooleanFieldType,    0,            1,  getCyclePalettes,    NULL,         setCyclePalettes    },
-  { "paletteDuration",    "Palette Duration",  NumberFieldType,     1,          255,  getPaletteDuration,  NULL,         setPaletteDuration  },
-  
-  { "solidColorSection",  "Solid Color",       SectionFieldType,    0,            0,  NULL,                NULL,         NULL                },
-  { "solidColor",         "Color",             ColorFieldType,      0,          255,  getSolidColor,       NULL,         setSolidColor       },
-  
-  { "fire",               "Fire & Water",      SectionFieldType,    0,            0,  NULL,                NULL,         NULL                },
-  { "cooling",            "Cooling",           NumberFieldType,     0,          255,  getCooling,          NULL, setCooling                  },
-  { "sparking",           "Sparking",          NumberFieldType,     0,          255,  getSparking,         NULL, setSparking                 },
-  
-  { "twinklesSection",    "Twinkles",          SectionFieldType,    0,            0,  NULL,                NULL,         NULL                },
-  { "twinkleSpeed",       "Twinkle Speed",     NumberFieldType,     0,            8,  getTwinkleSpeed,     NULL, setTwinkleSpeed             },
-  { "twinkleDensity",     "Twinkle Density",   NumberFieldType,     0,            8,  getTwinkleDensity,   NULL, setTwinkleDensity           },
-
-  { "displayDesction",    "Display Params",    SectionFieldType,    0,            0,  NULL,                NULL,         NULL                },
-  { "mirrored",           "Mirror LEDS",       BooleanFieldType,    0,            1,  getMirrored,         NULL,         setMirrored         },
-  { "maxPower",           "Max POWER (x20w)",  NumberFieldType,     0,            255,getMaxPower,         NULL,         setMaxPower         },
-};
-
-uint8_t fieldCount = ARRAY_SIZE(fields);
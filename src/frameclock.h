@@ -0,0 +1,143 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Frame clock: a periodic esp_timer notifies the loop task once a frame, so
+// loop() blocks between frames instead of spinning on EVERY_N_MILLIS and the
+// playback buffer.
+//
+// With power off the skate goes idle once the last black frames have played
+// out here and on the remote skate: the clock stops, rendering and sync
+// traffic stop, WiFi drops to max modem sleep and the CPU clock comes down.
+// Builds with power management and tickless idle also get automatic light
+// sleep between beacons. The loop still wakes every IDLE_POLL_MILLIS for
+// the WebSocket server, and at once when powerChanged() notifies it.
+
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+#include "esp_pm.h"
+#endif
+
+#define IDLE_POLL_MILLIS 50
+#define IDLE_CPU_MHZ 80
+// long enough for the remote skate to play out its buffered frames too
+#define POWER_OFF_DRAIN_MILLIS (BUFFER_DELAY + 100)
+
+// metrics.h
+extern TaskHandle_t loopTaskHandle;
+
+esp_timer_handle_t frameTimer = NULL;
+bool idle = false;
+unsigned long powerOffMillis = 0;   // 0 while power is on
+uint32_t activeCpuMHz;
+
+void onFrameTimer(void *arg)
+{
+  xTaskNotifyGive(loopTaskHandle);
+}
+
+// onChange for the power field, may run on the web task
+void powerChanged()
+{
+  if (loopTaskHandle)
+  {
+    xTaskNotifyGive(loopTaskHandle);
+  }
+}
+
+void startFrameClock()
+{
+  if (!frameTimer)
+  {
+    esp_timer_create_args_t args = {};
+    args.callback = onFrameTimer;
+    args.name = "frame";
+    esp_timer_create(&args, &frameTimer);
+  }
+  esp_timer_start_periodic(frameTimer, 1000000UL / FRAMES_PER_SECOND);
+}
+
+// Blocks the loop until the next frame, or while idle until a notification
+// or the next WebSocket poll
+void waitForFrame()
+{
+  ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(idle ? IDLE_POLL_MILLIS : 100));
+}
+
+void setLightSleep(bool enable)
+{
+#if CONFIG_PM_ENABLE && CONFIG_FREERTOS_USE_TICKLESS_IDLE
+  esp_pm_config_esp32_t config = {};
+  config.max_freq_mhz = activeCpuMHz;
+  config.min_freq_mhz = enable ? 40 : activeCpuMHz;
+  config.light_sleep_enable = enable;
+  esp_pm_configure(&config);
+#else
+  setCpuFrequencyMhz(enable ? IDLE_CPU_MHZ : activeCpuMHz);
+#endif
+}
+
+void enterIdle()
+{
+  idle = true;
+  esp_timer_stop(frameTimer);
+  activeCpuMHz = getCpuFrequencyMhz();
+  // no effect while the access point is up, only station mode can doze
+  esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+  setLightSleep(true);
+  LOG_INFO("Power off, idling");
+}
+
+void exitIdle()
+{
+  setLightSleep(false);
+  esp_wifi_set_ps(WIFI_PS_MIN_MODEM);
+  idle = false;
+  startFrameClock();
+  LOG_INFO("Power on, rendering");
+}
+
+// Once per loop pass. Returns true while idle, when the loop should neither
+// render nor play back.
+bool updateIdle()
+{
+  if (power)
+  {
+    powerOffMillis = 0;
+    if (idle)
+    {
+      exitIdle();
+    }
+    return false;
+  }
+
+  unsigned long now = millis();
+  if (!powerOffMillis)
+  {
+    powerOffMillis = now;
+  }
+  else if (!idle && now - powerOffMillis > POWER_OFF_DRAIN_MILLIS && buffer.isEmpty())
+  {
+    enterIdle();
+  }
+  return idle;
+}
@@ -0,0 +1,242 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// LED driver: sends played back frames to the strip. The default backend
+// encodes a frame into RMT items and returns while the peripheral clocks it
+// out; the RMT end-of-transmission interrupt reports completion through the
+// onDone() callback. Interrupts stay enabled throughout, so WiFi and
+// rendering keep running during the ~30 us per led on the wire.
+//
+// -D LED_DRIVER_FASTLED uses FastLED's blocking show() instead, for other
+// chipsets; -D LED_DRIVER_SIM keeps the encoded frame in memory and
+// completes at once, for running without a strip.
+
+#if !defined(LED_DRIVER_FASTLED) && !defined(LED_DRIVER_SIM)
+#include <driver/rmt.h>
+#endif
+
+// WS2812 bit timings in 25 ns RMT ticks (80 MHz APB / LED_RMT_CLOCK_DIV)
+#define LED_RMT_CLOCK_DIV 2
+#define LED_T0H 16          // 0.4 us
+#define LED_T0L 34          // 0.85 us
+#define LED_T1H 32          // 0.8 us
+#define LED_T1L 18          // 0.45 us
+#define LED_LATCH 12000     // 300 us low after the last bit, newer WS2812B need 280
+#define LED_RMT_CHANNEL RMT_CHANNEL_0
+// four of the eight RMT memory blocks, so the refill interrupt has 160 us
+// of slack instead of 40
+#define LED_RMT_MEM_BLOCKS 4
+
+// an RMT item: high for `high` ticks, then low for `low` ticks
+#define LED_ITEM(high, low) ((uint32_t)(high) | (1UL << 15) | ((uint32_t)(low) << 16))
+
+typedef void (*LedDriverCallback)(void *arg);
+
+class LedDriver
+{
+public:
+  virtual ~LedDriver() {}
+  virtual void begin() = 0;
+  // Starts sending count pixels, scaled by brightness. Returns false, and
+  // sends nothing, while the previous frame is still going out.
+  virtual bool show(const CRGB *pixels, uint16_t count, uint8_t brightness) = 0;
+  bool busy() const { return sending; }
+
+  // called when a frame has been sent and latched, possibly from an interrupt
+  void onDone(LedDriverCallback callback, void *arg = NULL)
+  {
+    doneCallback = callback;
+    doneArg = arg;
+  }
+
+protected:
+  volatile bool sending = false;
+  LedDriverCallback doneCallback = NULL;
+  void *doneArg = NULL;
+
+  void done()
+  {
+    sending = false;
+    if (doneCallback)
+    {
+      doneCallback(doneArg);
+    }
+  }
+};
+
+// Pulse encoding shared by the RMT and simulated backends: 24 items per
+// pixel, in COLOR_ORDER, most significant bit first. Brightness is applied
+// with output.h's ordered dither, moving every frame, in place of FastLED's
+// temporal dithering, so low brightness fades don't band.
+class EncodingLedDriver : public LedDriver
+{
+protected:
+  uint32_t items[SKATE_LED_LENGTH * 24];
+  uint8_t ditherFrame = 0;
+
+  uint16_t encode(const CRGB *pixels, uint16_t count, uint8_t brightness)
+  {
+    // FastLED's EOrder packs the channel indexes as octal digits
+    static const uint8_t order[3] = {(COLOR_ORDER >> 6) & 3, (COLOR_ORDER >> 3) & 3, COLOR_ORDER & 3};
+
+    count = min(count, (uint16_t)(SKATE_LED_LENGTH));
+    uint16_t scale = brightness + 1;
+    uint8_t phase = ditherFrame++;
+    uint32_t *item = items;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      uint8_t dither = outputDither[(phase + i) & 7];
+      for (uint8_t c = 0; c < 3; c++)
+      {
+        uint8_t value = pixels[i].raw[order[c]];
+        if (brightness != 255 && value)
+        {
+          // at most (255 * 256 + 224) >> 8, no overflow
+          value = (value * scale + dither) >> 8;
+        }
+        for (uint8_t bit = 0; bit < 8; bit++)
+        {
+          *item++ = (value & 0x80) ? LED_ITEM(LED_T1H, LED_T1L) : LED_ITEM(LED_T0H, LED_T0L);
+          value <<= 1;
+        }
+      }
+    }
+    uint16_t n = item - items;
+    if (n)
+    {
+      // stretch the last low period into the latch, so done means latched
+      items[n - 1] = (items[n - 1] & 0xFFFF) | ((uint32_t)LED_LATCH << 16);
+    }
+    return n;
+  }
+};
+
+#if defined(LED_DRIVER_FASTLED)
+
+class FastLedDriver : public LedDriver
+{
+public:
+  void begin() override
+  {
+    FastLED.addLeds<LED_TYPE, ESP_DATA_PIN, COLOR_ORDER>(frame, SKATE_LED_LENGTH).setCorrection(UncorrectedColor); // white balance is done in output.h
+#ifdef RENDER_DEPTH_16
+    // output.h dithers while it applies brightness
+    FastLED.setDither(DISABLE_DITHER);
+#endif
+  }
+
+  bool show(const CRGB *pixels, uint16_t count, uint8_t brightness) override
+  {
+    memcpy(frame, pixels, min(count, (uint16_t)(SKATE_LED_LENGTH)) * sizeof(CRGB));
+    FastLED.setBrightness(brightness);
+    FastLED.show();
+    done();
+    return true;
+  }
+
+private:
+  CRGB frame[SKATE_LED_LENGTH];
+};
+
+typedef FastLedDriver SelectedLedDriver;
+
+#elif defined(LED_DRIVER_SIM)
+
+class SimLedDriver : public EncodingLedDriver
+{
+public:
+  uint32_t frames = 0;
+  uint16_t itemCount = 0;
+
+  void begin() override {}
+
+  bool show(const CRGB *pixels, uint16_t count, uint8_t brightness) override
+  {
+    itemCount = encode(pixels, count, brightness);
+    frames++;
+    done();
+    return true;
+  }
+
+  // the last frame as it would have gone out on the wire
+  const uint32_t *encoded() const { return items; }
+};
+
+typedef SimLedDriver SelectedLedDriver;
+
+#else
+
+class RmtLedDriver : public EncodingLedDriver
+{
+public:
+  void begin() override
+  {
+    rmt_config_t config = {};
+    config.rmt_mode = RMT_MODE_TX;
+    config.channel = LED_RMT_CHANNEL;
+    config.gpio_num = (gpio_num_t)ESP_DATA_PIN;
+    config.mem_block_num = LED_RMT_MEM_BLOCKS;
+    config.clk_div = LED_RMT_CLOCK_DIV;
+    config.tx_config.loop_en = false;
+    config.tx_config.carrier_en = false;
+    config.tx_config.idle_output_en = true;
+    config.tx_config.idle_level = RMT_IDLE_LEVEL_LOW;
+    rmt_config(&config);
+    rmt_driver_install(LED_RMT_CHANNEL, 0, 0);
+    rmt_register_tx_end_callback(onTransmitEnd, this);
+  }
+
+  bool show(const CRGB *pixels, uint16_t count, uint8_t brightness) override
+  {
+    if (sending)
+    {
+      return false;
+    }
+    // items is only rewritten once the last frame has gone out, the driver
+    // refills the RMT memory from it while sending
+    uint16_t n = encode(pixels, count, brightness);
+    if (!n)
+    {
+      return true;
+    }
+    sending = true;
+    rmt_write_items(LED_RMT_CHANNEL, (const rmt_item32_t *)items, n, false);
+    return true;
+  }
+
+private:
+  static void onTransmitEnd(rmt_channel_t channel, void *arg)
+  {
+    if (channel == LED_RMT_CHANNEL)
+    {
+      ((RmtLedDriver *)arg)->done();
+    }
+  }
+};
+
+typedef RmtLedDriver SelectedLedDriver;
+
+#endif
+
+SelectedLedDriver ledDriver;
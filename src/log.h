@@ -0,0 +1,157 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Leveled logging that never blocks the caller on the UART.
+//
+// LOG_ERROR/LOG_WARN/LOG_INFO/LOG_DEBUG format into a fixed ring of message
+// slots; a low priority task on core 0 drains the ring to Serial and, when
+// built with -D LOG_SYSLOG_PORT=514, broadcasts it as UDP syslog. Any task
+// may log: a slot is claimed with a compare-and-swap and published with a
+// sequence number, so there's no lock. When the ring is full the message is
+// dropped and counted rather than waiting.
+//
+// Levels above LOG_LEVEL compile out entirely, arguments included.
+
+#define LOG_LEVEL_NONE 0
+#define LOG_LEVEL_ERROR 1
+#define LOG_LEVEL_WARN 2
+#define LOG_LEVEL_INFO 3
+#define LOG_LEVEL_DEBUG 4
+
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_LEVEL_INFO
+#endif
+
+#define LOG_SLOTS 32 // must be a power of two
+#define LOG_MESSAGE_SIZE 120
+#define LOG_DRAIN_PERIOD_MS 20
+
+struct LogSlot
+{
+  uint32_t sequence; // claim number + 1 once the message is complete
+  uint8_t level;
+  char message[LOG_MESSAGE_SIZE];
+};
+
+LogSlot logSlots[LOG_SLOTS];
+uint32_t logHead = 0; // messages claimed
+uint32_t logTail = 0; // messages drained
+uint32_t logDropped = 0;
+
+void logPrintf(uint8_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+void logPrintf(uint8_t level, const char *format, ...)
+{
+  uint32_t claim = __atomic_load_n(&logHead, __ATOMIC_RELAXED);
+  do
+  {
+    if (claim - __atomic_load_n(&logTail, __ATOMIC_ACQUIRE) >= LOG_SLOTS)
+    {
+      __atomic_fetch_add(&logDropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+  } while (!__atomic_compare_exchange_n(&logHead, &claim, claim + 1, true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+  LogSlot &slot = logSlots[claim & (LOG_SLOTS - 1)];
+  slot.level = level;
+  va_list args;
+  va_start(args, format);
+  vsnprintf(slot.message, sizeof(slot.message), format, args);
+  va_end(args);
+  __atomic_store_n(&slot.sequence, claim + 1, __ATOMIC_RELEASE);
+}
+
+#if LOG_LEVEL >= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) logPrintf(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_WARN
+#define LOG_WARN(...) logPrintf(LOG_LEVEL_WARN, __VA_ARGS__)
+#else
+#define LOG_WARN(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_INFO
+#define LOG_INFO(...) logPrintf(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) do {} while (0)
+#endif
+
+#if LOG_LEVEL >= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) logPrintf(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) do {} while (0)
+#endif
+
+const char logLevelLetters[] = "-EWID";
+
+void writeLogMessage(uint8_t level, const char *message)
+{
+  Serial.printf("%c %s\n", logLevelLetters[level], message);
+
+#ifdef LOG_SYSLOG_PORT
+  // RFC 3164, facility local0; severities error 3, warning 4, info 6, debug 7
+  static const uint8_t severities[] = {7, 3, 4, 6, 7};
+  char packet[LOG_MESSAGE_SIZE + 32];
+  int length = snprintf(packet, sizeof(packet), "<%u>%s: %s", 16 * 8 + severities[level], WIFI_NAME, message);
+  udp.broadcastTo((uint8_t *)packet, min(length, (int)sizeof(packet) - 1), LOG_SYSLOG_PORT);
+#endif
+}
+
+void logTask(void *pvParameters)
+{
+  uint32_t reportedDropped = 0;
+
+  for (;;)
+  {
+    for (;;)
+    {
+      LogSlot &slot = logSlots[logTail & (LOG_SLOTS - 1)];
+      if (__atomic_load_n(&slot.sequence, __ATOMIC_ACQUIRE) != logTail + 1)
+        break;
+      writeLogMessage(slot.level, slot.message);
+      __atomic_store_n(&logTail, logTail + 1, __ATOMIC_RELEASE);
+    }
+
+    uint32_t dropped = __atomic_load_n(&logDropped, __ATOMIC_RELAXED);
+    if (dropped != reportedDropped)
+    {
+      char message[40];
+      snprintf(message, sizeof(message), "%u log messages dropped", dropped - reportedDropped);
+      writeLogMessage(LOG_LEVEL_WARN, message);
+      reportedDropped = dropped;
+    }
+
+    vTaskDelay(LOG_DRAIN_PERIOD_MS / portTICK_PERIOD_MS);
+  }
+}
+
+TaskHandle_t logTaskHandle = NULL;
+
+void setupLog()
+{
+  xTaskCreatePinnedToCore(logTask, "log", 3072, NULL, tskIDLE_PRIORITY + 1, &logTaskHandle, 0);
+}
@@ -22,8 +22,12 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#ifdef LED_DRIVER_FASTLED
 #define FASTLED_INTERRUPT_RETRY_COUNT 0
 #define FASTLED_ALLOW_INTERRUPTS 0
+#endif
+// pattern timing runs on get_millisecond_timer(), see warmstate.h
+#define USE_GET_MILLISECOND_TIMER
 
 #include <Arduino.h>
 #include <FastLED.h>
@@ -84,12 +88,18 @@ uint8_t cooling = 50;
 // Default 120, suggested range 50-200.
 uint8_t sparking = 120;
 
+// FLAMES: How many independent flames the leds are split into, every other
+// one burning from the far end.
+#define FLAMES_MAX 4
+uint8_t flames = 1;
+
 CRGB solidColor = CRGB::Blue;
 
 uint8_t cyclePalettes = 0;
 uint8_t paletteDuration = 10;
 uint8_t currentPaletteIndex = 0;
 unsigned long paletteTimeout = 0;
+unsigned long renderMicros = 0; // time the last frame took to render
 
 #define ARRAY_SIZE(A) (sizeof(A) / sizeof((A)[0]))
 
@@ -116,8 +126,9 @@ unsigned long paletteTimeout = 0;
 
 // THIS is because every sketch has different counts
 #define NUM_LEDS (mirrored == 1 ? SKATE_LED_LENGTH : (SKATE_LED_LENGTH * 2))
+#include "depth.h"
 // animation buffer for routines to write into
-CRGB leds[SKATE_LED_LENGTH * 2];
+RenderPixel leds[SKATE_LED_LENGTH * 2];
 
 #define FRAMES_PER_SECOND 120
 
@@ -148,13 +159,26 @@ CircularBuffer<field_update_message, BUFFER_SIZE> buffer;
 field_update_message playback;
 
 
+#include "log.h"
+#include "trace.h"
 #include "patterns.h"
-
-#include "field.h"
-#include "fields.h"
+#include "transitions.h"
+#include "segments.h"
+#include "output.h"
+#include "power.h"
+#include "leddriver.h"
+#include "warmstate.h"
 
 #include "secrets.h"
 #include "wifi_setup.h"
+#include "frameclock.h"
+
+#include "field.h"
+#include "fields.h"
+#include "settings.h"
+#include "transaction.h"
+#include "scenes.h"
+#include "metrics.h"
 
 #include "web.h"
 
@@ -256,17 +280,14 @@ void nextPattern()
   // add one to the current pattern number, and wrap around at the end
   currentPatternIndex = (currentPatternIndex + 1) % patternCount;
   // updateOtherClients(); // broadcast esp now
-  String json = "{\"name\":\"pattern\",\"value\":\"" + String(currentPatternIndex) + "\"}";
-  webSocketsServer.broadcastTXT(json);
+  broadcastFieldValue(*getField("pattern", fieldTable));
 }
 
 void nextPalette()
 {
   currentPaletteIndex = (currentPaletteIndex + 1) % paletteCount;
-  targetPalette = palettes[currentPaletteIndex];
   // updateOtherClients(); // broadcast esp now
-  String json = "{\"name\":\"palette\",\"value\":\"" + String(currentPaletteIndex) + "\"}";
-  webSocketsServer.broadcastTXT(json);
+  broadcastFieldValue(*getField("palette", fieldTable));
 }
 
 const char * udpAddress = "192.168.4.2";
@@ -279,15 +300,12 @@ void udpSendTest(unsigned long scheduledTime) {
     myData.brightness = brightness;
     myData.ledCount = SKATE_LED_LENGTH;
     myData.millis = scheduledTime;
-    if (mirrored) {
-      memcpy(&myData.leds, &leds[0], sizeof(myData.leds));
-    } else {
-      std::reverse_copy(&leds[SKATE_LED_LENGTH], &leds[SKATE_LED_LENGTH * 2], myData.leds);
-    }
+    writeOutput(RemoteOutput, leds, myData.leds);
     // memcpy(&myData.leds, &leds[mirrored ? 0 : (NUM_LEDS_PER_STRIP * 2)], sizeof(myData.leds));
     // buffer.push(myData);
     // AsyncUDPMessage message = AsyncUDPMessage(sizeof(myData));
-    udp.broadcastTo((uint8_t *) &myData, sizeof(myData), 4210);
+    TRACE_SCOPE("udp send");
+    countUdpSend(udp.broadcastTo((uint8_t *) &myData, sizeof(myData), 4210), sizeof(myData));
     // udp.writeTo((uint8_t *) &myData, sizeof(myData), IP_ADDR_BROADCAST , TCPIP_ADAPTER_IF_MAX);
     // message.
     // udp.write()
@@ -302,10 +320,103 @@ void udpSendTest(unsigned long scheduledTime) {
 void udpTimeHandler(AsyncUDPPacket packet) {
   unsigned long timeIn = millis();
   udp.writeTo((uint8_t *)&timeIn, sizeof(timeIn), packet.remoteIP(), packet.remotePort());
-  Serial.println("GOT TIME REQUEST!!!");
+  LOG_DEBUG("time request from %s", packet.remoteIP().toString().c_str());
 }
 // #endif
 
+// frames the strip has fully received, counted from the driver's callback
+volatile uint32_t ledFramesShown = 0;
+
+void onLedFrameDone(void *arg)
+{
+  ledFramesShown++;
+}
+
+// Renders one frame of the current state into leds
+void renderFrame()
+{
+  if (power == 0)
+  {
+    clearPixels(leds, NUM_LEDS);
+  }
+  else
+  {
+    // Render the current pattern once, updating the 'leds' array
+    TRACE_SCOPE("render");
+    unsigned long renderStart = micros();
+    updatePaletteLUTs();
+    if (segmentCount > 0)
+    {
+      renderSegments(leds, NUM_LEDS);
+    }
+    else
+    {
+      releaseSegmentPaletteLUTs();
+      renderPatterns(leds, NUM_LEDS);
+    }
+    renderMicros = micros() - renderStart;
+    countFrame(renderStart, renderMicros);
+
+    EVERY_N_MILLISECONDS(40)
+    {
+      // slowly blend the current palette to the next
+      nblendPaletteTowardPalette(currentPalette, targetPalette, 8);
+      gHue++; // slowly cycle the "base color" through the rainbow
+    }
+
+    // if esp slave don't auto move forward
+    if (autoplay == 1 && (millis() > autoPlayTimeout))
+    {
+      nextPattern();
+      autoPlayTimeout = millis() + (autoplayDuration * 1000);
+    }
+
+    if (cyclePalettes == 1 && (millis() > paletteTimeout))
+    {
+      nextPalette();
+      paletteTimeout = millis() + (paletteDuration * 1000);
+    }
+  }
+}
+
+// Network bring-up runs here, in parallel with rendering, so the LEDs don't
+// wait on the softAP or the web servers at boot. The task then stays to run
+// the WiFi state machine, whose radio calls may block.
+volatile bool networkReady = false;
+
+void networkTask(void *parameter)
+{
+  setupScenes();
+  setupWifi();
+  setupWeb();
+
+  //  if(udp.listen(4210)) {
+  //       Serial.print("UDP Listening on IP: ");
+  //       Serial.println(WiFi.localIP());
+  //       udp.onPacket([](AsyncUDPPacket packet) {
+  //       }
+  // #ifdef ESP32
+  if (udp.listen(TIME_SYNC_UDP_LISTEN)) {
+    LOG_INFO("UDP time service listening on port %u", TIME_SYNC_UDP_LISTEN);
+    udp.onPacket(udpTimeHandler);
+  }
+  // #endif
+
+  bootNetworkMicros = micros();
+  LOG_INFO("Network up %lu ms after boot", (unsigned long)(bootNetworkMicros / 1000));
+  networkReady = true;
+
+  for (;;)
+  {
+    handleWifi();
+    vTaskDelay(pdMS_TO_TICKS(WIFI_TASK_PERIOD_MS));
+  }
+}
+
+// The tests in test/ include this file for everything above and bring their
+// own entry points.
+#ifndef PIO_UNIT_TESTING
+
 void setup()
 {
   // delay(5000);
@@ -314,18 +425,14 @@ void setup()
   digitalWrite(led, 1);
 
   Serial.begin(115200);
-
-  SPIFFS.begin();
-  // listDir(SPIFFS, "/", 1);
-
-  // restore from memory
-  loadFieldsFromEEPROM(fields, fieldCount);
-  setupWifi();
-  setupWeb();
+  setupLog();
+  loopTaskHandle = xTaskGetCurrentTaskHandle();
 
   // three-wire LEDs (WS2811, WS2812, NeoPixel)
   // playback from inside a struct
-  FastLED.addLeds<LED_TYPE, ESP_DATA_PIN, COLOR_ORDER>(playback.leds, SKATE_LED_LENGTH).setCorrection(TypicalLEDStrip);
+  // see leddriver.h, white balance is done in output.h
+  ledDriver.begin();
+  ledDriver.onDone(onLedFrameDone);
 
   // four-wire LEDs (APA102, DotStar)
   //FastLED.addLeds<LED_TYPE,ESP_DATA_PIN,CLK_PIN,COLOR_ORDER>(leds, NUM_LEDS).setCorrection(TypicalLEDStrip);
@@ -340,24 +447,29 @@ void setup()
   // FastLED.addLeds<LED_TYPE, 14, COLOR_ORDER>(leds, 6 * NUM_LEDS_PER_STRIP, NUM_LEDS_PER_STRIP).setCorrection(TypicalLEDStrip);
   // FastLED.addLeds<LED_TYPE, SCL, COLOR_ORDER>(leds, 7 * NUM_LEDS_PER_STRIP, NUM_LEDS_PER_STRIP).setCorrection(TypicalLEDStrip);
 
-  FastLED.setMaxPowerInVoltsAndMilliamps(5, MAX_POWER_CONVERSION);
-  set_max_power_indicator_LED(LED_BUILTIN);
-  // set master brightness control
-  FastLED.setBrightness(brightness);
+  // brightness and the power limit are set per frame, see power.h
+
+  // restore from memory
+  SPIFFS.begin();
+  // listDir(SPIFFS, "/", 1);
+  setupSettings(fieldTable);
+  loadSegments();
+  restoreWarmState();
+  setupPalettes();
 
   autoPlayTimeout = millis() + (autoplayDuration * 1000);
 
-  //  if(udp.listen(4210)) {
-  //       Serial.print("UDP Listening on IP: ");
-  //       Serial.println(WiFi.localIP());
-  //       udp.onPacket([](AsyncUDPPacket packet) {
-  //       }
-  // #ifdef ESP32
-  if (udp.listen(TIME_SYNC_UDP_LISTEN)) {
-    Serial.print("UDP Listening on port for time service: ");
-    udp.onPacket(udpTimeHandler);
-  }
-  // #endif
+  // show the restored state straight away; the loop's frames follow once
+  // they come out of the playback buffer
+  renderFrame();
+  writeOutput(LocalOutput, leds, playback.leds);
+  ledDriver.show(playback.leds, SKATE_LED_LENGTH, limitOutputPower());
+  bootFirstFrameMicros = micros();
+  LOG_INFO("First frame %lu ms after boot", (unsigned long)(bootFirstFrameMicros / 1000));
+
+  xTaskCreatePinnedToCore(networkTask, "network", 8192, NULL, tskIDLE_PRIORITY + 1, &networkTaskHandle, 0);
+  startFrameClock();
+
   // #ifdef ESP8266
   // timeUdp.begin(TIME_SYNC_UDP_LISTEN);
   // // #endif
@@ -387,38 +499,25 @@ void loop()
   // }
   // #endif
   // Serial.println("loop start");
-  handleWeb();
-  // animate at 120 FPS
-  EVERY_N_MILLIS(1000/FRAMES_PER_SECOND){
-  // Serial.println("every n ms start");
-  if (power == 0)
+  // animate at 120 FPS, paced by the frame clock
+  waitForFrame();
+  if (networkReady)
   {
-        fill_solid(leds, NUM_LEDS, CRGB::Black);
+    handleWeb();
   }
-  else
+  // apply scene recalls and batch updates between frames
+  applyFieldTransaction(fieldTable);
+  if (updateIdle())
   {
-    // Call the current pattern function once, updating the 'leds' array
-    patterns[currentPatternIndex].pattern(leds, NUM_LEDS);
-      
-    EVERY_N_MILLISECONDS(40)
-    {
-      // slowly blend the current palette to the next
-      nblendPaletteTowardPalette(currentPalette, targetPalette, 8);
-      gHue++; // slowly cycle the "base color" through the rainbow
-    }
+    return;
+  }
 
-  // if esp slave don't auto move forward
-    if (autoplay == 1 && (millis() > autoPlayTimeout))
-    {
-      nextPattern();
-      autoPlayTimeout = millis() + (autoplayDuration * 1000);
-    }
+  // Serial.println("every n ms start");
+  renderFrame();
 
-    if (cyclePalettes == 1 && (millis() > paletteTimeout))
-    {
-      nextPalette();
-      paletteTimeout = millis() + (paletteDuration * 1000);
-    }
+  EVERY_N_MILLIS(WARM_STATE_INTERVAL)
+  {
+    saveWarmState();
   }
 
     // send the 'leds' array out to the actual LED strip
@@ -435,37 +534,56 @@ void loop()
     // make sure both packets have same scheduled time
     ulong scheduledTime = millis() + BUFFER_DELAY;
     field_update_message myData;
-    myData.brightness = brightness;
     myData.mxPower = gMaxPower;
     myData.ledCount = SKATE_LED_LENGTH;
     myData.millis = scheduledTime;
     // Serial.println("have mydata");
-    memcpy(&myData.leds, leds, sizeof(myData.leds));
-    // Serial.println("after memcpy");
+    writeOutput(LocalOutput, leds, myData.leds);
+    myData.brightness = limitOutputPower();
     // in case bugger is too full drop an item from it
     if (!buffer.isFull()) {
       // Serial.println("adding to buffer");
+      TRACE_SCOPE("buffer push");
       buffer.push(myData);
+    } else {
+      metrics.droppedFrames++;
     }
     // Serial.println("every n ms end");
     #ifndef DISABLE_UDP
-    udpSendTest(scheduledTime); // buffer.push done inside here of 2nd half
+    if (networkReady)
+      udpSendTest(scheduledTime); // buffer.push done inside here of 2nd half
     #endif
     // delay(10);
-  }
 
   // check buffer for next scheduled packet and then animate if ready
 
-  if (!buffer.isEmpty()) {
+  // while the strip is still taking the last frame the next one waits
+  if (!buffer.isEmpty() && !ledDriver.busy()) {
     if (buffer.first().millis < millis()) {
       // frame scheduled for playback
       playback = buffer.shift();
-      FastLED.show(); 
+      // after a late pass more than one can be due, show the newest
+      while (!buffer.isEmpty() && buffer.first().millis < millis()) {
+        playback = buffer.shift();
+        metrics.skippedFrames++;
+      }
+      unsigned long showStart = micros();
+      {
+        TRACE_SCOPE("show");
+        ledDriver.show(playback.leds, SKATE_LED_LENGTH, playback.brightness);
+      }
+      countShow(micros() - showStart, millis() - playback.millis);
       EVERY_N_MILLIS(1000) {
-        Serial.print(F("FPS:")); Serial.println(FastLED.getFPS());
+        static uint32_t lastFramesShown = 0;
+        uint32_t shown = ledFramesShown;
+        LOG_INFO("FPS:%u render us:%lu mA:%u%s", shown - lastFramesShown, renderMicros, powerEstimateMilliamps,
+                 outgoingPatternSlot >= 0 ? " (transition)" : "");
+        lastFramesShown = shown;
       }
     }
   }
   // run loop at 250fps?
   // delay(4);
 }
+
+#endif // PIO_UNIT_TESTING
@@ -0,0 +1,214 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Runtime counters, served at /metrics in Prometheus text format.
+//
+// Counters are 32-bit words. Almost all have a single writer, the loop task,
+// so updates are plain increments and the web task reads them without locks;
+// the few bumped from more than one task use an atomic add.
+// Microsecond totals wrap after about 71 minutes of accumulated time, which
+// Prometheus treats as a counter reset.
+
+struct Metrics
+{
+  uint32_t frames;
+  uint32_t frameJitterMicros; // sum of |frame interval - target interval|
+  uint32_t frameJitterMaxMicros;
+  uint32_t renderMicros;
+  uint32_t shows;
+  uint32_t showMicros;
+  uint32_t showMaxMicros;
+  uint32_t droppedFrames;     // playback buffer was full
+  uint32_t lateFrames;        // played more than a frame after schedule
+  uint32_t skippedFrames;     // passed over for a newer due frame
+  uint32_t udpPackets;
+  uint32_t udpBytes;
+  uint32_t udpErrors;
+  uint32_t webSocketBroadcasts; // loop and web tasks, atomic
+};
+
+Metrics metrics;
+uint32_t patternRenders[patternCount];
+uint32_t patternRenderMicros[patternCount];
+
+TaskHandle_t loopTaskHandle = NULL;
+uint32_t lastFrameMicros = 0;
+
+// boot timing, micros() since reset
+uint32_t bootFirstFrameMicros;
+uint32_t bootNetworkMicros;
+
+#define FRAME_MICROS (1000000UL / FRAMES_PER_SECOND)
+
+void countPatternRender(uint8_t patternIndex, uint32_t micros)
+{
+  patternRenders[patternIndex]++;
+  patternRenderMicros[patternIndex] += micros;
+}
+
+void countFrame(uint32_t now, uint32_t renderMicros)
+{
+  if (lastFrameMicros)
+  {
+    uint32_t interval = now - lastFrameMicros;
+    uint32_t jitter = interval > FRAME_MICROS ? interval - FRAME_MICROS : FRAME_MICROS - interval;
+    metrics.frameJitterMicros += jitter;
+    metrics.frameJitterMaxMicros = max(metrics.frameJitterMaxMicros, jitter);
+  }
+  lastFrameMicros = now;
+  metrics.frames++;
+  metrics.renderMicros += renderMicros;
+}
+
+void countShow(uint32_t micros, unsigned long lateMillis)
+{
+  metrics.shows++;
+  metrics.showMicros += micros;
+  metrics.showMaxMicros = max(metrics.showMaxMicros, micros);
+  if (lateMillis * 1000 > FRAME_MICROS)
+    metrics.lateFrames++;
+}
+
+void countWebSocketBroadcast()
+{
+  __atomic_fetch_add(&metrics.webSocketBroadcasts, 1, __ATOMIC_RELAXED);
+}
+
+void countUdpSend(size_t sent, size_t length)
+{
+  if (sent == length)
+  {
+    metrics.udpPackets++;
+    metrics.udpBytes += sent;
+  }
+  else
+  {
+    metrics.udpErrors++;
+  }
+}
+
+void appendMetric(String &text, const char *name, const char *type, uint32_t value)
+{
+  text += "# TYPE skate_";
+  text += name;
+  text += ' ';
+  text += type;
+  text += "\nskate_";
+  text += name;
+  text += ' ';
+  text += value;
+  text += '\n';
+}
+
+void appendStackMetric(String &text, const char *task, TaskHandle_t handle)
+{
+  if (!handle)
+    return;
+  text += "skate_task_stack_free_min_bytes{task=\"";
+  text += task;
+  text += "\"} ";
+  text += uxTaskGetStackHighWaterMark(handle);
+  text += '\n';
+}
+
+// Called from the web server task.
+String getMetricsText()
+{
+  String text;
+  text.reserve(2048 + patternCount * 120);
+
+  appendMetric(text, "frames_total", "counter", metrics.frames);
+  appendMetric(text, "frame_jitter_microseconds_total", "counter", metrics.frameJitterMicros);
+  appendMetric(text, "frame_jitter_max_microseconds", "gauge", metrics.frameJitterMaxMicros);
+  appendMetric(text, "render_microseconds_total", "counter", metrics.renderMicros);
+  appendMetric(text, "shows_total", "counter", metrics.shows);
+  appendMetric(text, "show_microseconds_total", "counter", metrics.showMicros);
+  appendMetric(text, "show_max_microseconds", "gauge", metrics.showMaxMicros);
+  appendMetric(text, "frames_dropped_total", "counter", metrics.droppedFrames);
+  appendMetric(text, "frames_late_total", "counter", metrics.lateFrames);
+  appendMetric(text, "frames_skipped_total", "counter", metrics.skippedFrames);
+  appendMetric(text, "playback_buffer_frames", "gauge", buffer.size());
+  appendMetric(text, "udp_tx_packets_total", "counter", metrics.udpPackets);
+  appendMetric(text, "udp_tx_bytes_total", "counter", metrics.udpBytes);
+  appendMetric(text, "udp_tx_errors_total", "counter", metrics.udpErrors);
+  appendMetric(text, "websocket_clients", "gauge", webSocketsServer.connectedClients());
+  appendMetric(text, "websocket_broadcasts_total", "counter", metrics.webSocketBroadcasts);
+  appendMetric(text, "heap_free_bytes", "gauge", ESP.getFreeHeap());
+  appendMetric(text, "heap_free_min_bytes", "gauge", ESP.getMinFreeHeap());
+  appendMetric(text, "heap_largest_free_block_bytes", "gauge", ESP.getMaxAllocHeap());
+  appendMetric(text, "power_milliamps", "gauge", powerEstimateMilliamps);
+  appendMetric(text, "boot_first_frame_microseconds", "gauge", bootFirstFrameMicros);
+  appendMetric(text, "boot_network_microseconds", "gauge", bootNetworkMicros);
+  appendMetric(text, "wifi_connected", "gauge", wifiState == WifiConnected);
+  appendMetric(text, "wifi_fallback_access_point", "gauge", wifiFallbackAccessPoint);
+  appendMetric(text, "wifi_connect_attempts_total", "counter", wifiStats.attempts);
+  appendMetric(text, "wifi_connects_total", "counter", wifiStats.connects);
+  appendMetric(text, "wifi_disconnects_total", "counter", wifiStats.disconnects);
+  appendMetric(text, "wifi_fallbacks_total", "counter", wifiStats.fallbacks);
+  appendMetric(text, "wifi_last_connect_milliseconds", "gauge", wifiStats.lastConnectMillis);
+  appendMetric(text, "wifi_connect_milliseconds_total", "counter", wifiStats.totalConnectMillis);
+
+  text += "# TYPE skate_pattern_renders_total counter\n";
+  for (uint8_t i = 0; i < patternCount; i++)
+  {
+    text += "skate_pattern_renders_total{pattern=\"";
+    text += patterns[i].name;
+    text += "\"} ";
+    text += patternRenders[i];
+    text += '\n';
+  }
+  text += "# TYPE skate_pattern_render_microseconds_total counter\n";
+  for (uint8_t i = 0; i < patternCount; i++)
+  {
+    text += "skate_pattern_render_microseconds_total{pattern=\"";
+    text += patterns[i].name;
+    text += "\"} ";
+    text += patternRenderMicros[i];
+    text += '\n';
+  }
+  // per running instance, 1 at full quality, 2 or 4 while over its CPU budget
+  text += "# TYPE skate_pattern_frame_divider gauge\n";
+  for (uint8_t i = 0; i < PATTERN_SLOTS; i++)
+  {
+    if (!patternSlots[i].pattern)
+      continue;
+    text += "skate_pattern_frame_divider{slot=\"";
+    text += i;
+    text += "\",pattern=\"";
+    text += patterns[patternSlots[i].patternIndex].name;
+    text += "\"} ";
+    text += max(patternSlots[i].budget.divider, (uint8_t)1);
+    text += '\n';
+  }
+
+  // high water marks, so the least stack each task has ever had left
+  text += "# TYPE skate_task_stack_free_min_bytes gauge\n";
+  appendStackMetric(text, "loop", loopTaskHandle);
+  appendStackMetric(text, "settings", settingsTaskHandle);
+  appendStackMetric(text, "network", networkTaskHandle);
+  appendStackMetric(text, "log", logTaskHandle);
+  appendStackMetric(text, "web", xTaskGetCurrentTaskHandle());
+
+  return text;
+}
@@ -0,0 +1,167 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The output stage is the one place rendered leds[] become device pixels,
+// for this skate and for the other one over UDP. Each device has an index map
+// into leds[] (offset, interleave, mirror, reverse) and a per-channel curve with gamma and that
+// device's white balance folded together, so every output pixel is read once
+// and costs three table lookups. With RENDER_DEPTH_16 (see depth.h) the
+// curves are 16-bit, this skate's brightness is applied here too, and each
+// channel is dithered down to 8 bits with a pattern that moves every frame.
+
+enum OutputDevice : uint8_t
+{
+  LocalOutput,  // this skate, through the playback buffer
+  RemoteOutput, // the other skate, over UDP
+  OUTPUT_DEVICES
+};
+
+uint8_t outputGamma = 10; // gamma x10, 10 is linear
+
+// Strip wiring, the same on both skates: the strip's first LED shows skate
+// position outputOffset, and an interleaved strip is wired as
+// outputInterleave runs, each taking every outputInterleave-th position.
+#define OUTPUT_OFFSET_MAX (SKATE_LED_LENGTH > 255 ? 255 : SKATE_LED_LENGTH - 1)
+#define OUTPUT_INTERLEAVE_MAX 8
+uint8_t outputOffset = 0;
+uint8_t outputInterleave = 1; // 1 is one straight run
+CRGB localWhiteBalance = CRGB(TypicalLEDStrip);
+CRGB remoteWhiteBalance = CRGB(UncorrectedColor);
+
+#ifdef RENDER_DEPTH_16
+// indexed by the top byte of a channel, plus one entry to interpolate toward
+#define OUTPUT_CURVE_SIZE 257
+#define OUTPUT_CURVE_MAX 65535
+#define OUTPUT_CURVE_STEP 256
+typedef uint16_t OutputCurve[OUTPUT_CURVE_SIZE];
+
+uint8_t outputDitherFrame[OUTPUT_DEVICES];
+#else
+#define OUTPUT_CURVE_SIZE 256
+#define OUTPUT_CURVE_MAX 255
+#define OUTPUT_CURVE_STEP 1
+typedef uint8_t OutputCurve[OUTPUT_CURVE_SIZE];
+#endif
+
+// dither offsets, cycled per pixel and per frame; leddriver.h uses them too
+const uint8_t outputDither[8] = {0, 128, 64, 192, 32, 160, 96, 224};
+
+uint16_t outputMap[OUTPUT_DEVICES][SKATE_LED_LENGTH];
+// per channel totals of the last frame written for this skate, see power.h
+uint32_t outputChannelSums[3];
+OutputCurve outputCurves[OUTPUT_DEVICES][3];
+bool outputStageDirty = true;
+
+// onChange for every field the output stage depends on
+void outputStageChanged()
+{
+  outputStageDirty = true;
+}
+
+void buildOutputStage()
+{
+  uint8_t runs = constrain(outputInterleave, 1, OUTPUT_INTERLEAVE_MAX);
+  uint16_t i = 0;
+  for (uint8_t run = 0; run < runs; run++)
+  {
+    for (uint16_t position = run; position < SKATE_LED_LENGTH; position += runs)
+    {
+      uint16_t p = (position + outputOffset) % SKATE_LED_LENGTH;
+      outputMap[LocalOutput][i] = p;
+      // unmirrored, the other skate gets the second half, wired back to front
+      outputMap[RemoteOutput][i] = mirrored ? p : (SKATE_LED_LENGTH * 2 - 1) - p;
+      i++;
+    }
+  }
+
+  const CRGB whiteBalance[OUTPUT_DEVICES] = {localWhiteBalance, remoteWhiteBalance};
+  float gamma = outputGamma / 10.0f;
+  for (uint16_t i = 0; i < OUTPUT_CURVE_SIZE; i++)
+  {
+    float x = min((float)i * OUTPUT_CURVE_STEP / OUTPUT_CURVE_MAX, 1.0f);
+    uint32_t corrected = powf(x, gamma) * OUTPUT_CURVE_MAX + 0.5f;
+    for (uint8_t device = 0; device < OUTPUT_DEVICES; device++)
+    {
+      for (uint8_t channel = 0; channel < 3; channel++)
+      {
+        // same rounding as scale8()
+        outputCurves[device][channel][i] = (corrected * (whiteBalance[device].raw[channel] + 1)) >> 8;
+      }
+    }
+  }
+
+  outputStageDirty = false;
+}
+
+#ifdef RENDER_DEPTH_16
+inline uint8_t ditherChannel(const OutputCurve &curve, uint16_t value, uint16_t scale, uint8_t dither)
+{
+  uint8_t hi = value >> 8;
+  uint32_t corrected = curve[hi] + (((int32_t)(curve[hi + 1] - curve[hi]) * (value & 0xFF)) >> 8);
+  corrected = (corrected * scale) >> 8;
+  return min((corrected + dither) >> 8, (uint32_t)255);
+}
+#endif
+
+// Writes SKATE_LED_LENGTH device pixels from leds into out.
+void writeOutput(OutputDevice device, const RenderPixel *leds, CRGB *out)
+{
+  if (outputStageDirty)
+  {
+    buildOutputStage();
+  }
+
+  const uint16_t *map = outputMap[device];
+  const OutputCurve *curves = outputCurves[device];
+
+#ifdef RENDER_DEPTH_16
+  // the other skate scales by the brightness sent along with its frame
+  uint16_t scale = device == LocalOutput ? brightness + 1 : 256;
+  uint8_t phase = outputDitherFrame[device]++;
+#endif
+
+  uint32_t sums[3] = {0, 0, 0};
+  for (uint16_t i = 0; i < SKATE_LED_LENGTH; i++)
+  {
+    const RenderPixel &pixel = leds[map[i]];
+#ifdef RENDER_DEPTH_16
+    uint8_t dither = outputDither[(phase + i) & 7];
+    out[i].r = ditherChannel(curves[0], pixel.r, scale, dither);
+    out[i].g = ditherChannel(curves[1], pixel.g, scale, dither);
+    out[i].b = ditherChannel(curves[2], pixel.b, scale, dither);
+#else
+    out[i].r = curves[0][pixel.r];
+    out[i].g = curves[1][pixel.g];
+    out[i].b = curves[2][pixel.b];
+#endif
+    sums[0] += out[i].r;
+    sums[1] += out[i].g;
+    sums[2] += out[i].b;
+  }
+
+  if (device == LocalOutput)
+  {
+    memcpy(outputChannelSums, sums, sizeof(sums));
+  }
+}
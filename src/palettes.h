@@ -104,121 +104,276 @@ const TProgmemRGBPalette16 IcyBlue_p FL_PROGMEM =
   Ice_Blue2, Ice_Blue2, Ice_Blue2, Ice_Blue3
 };
 
-CRGBPalette16 IceColors_p = CRGBPalette16(CRGB::Black, CRGB::Blue, CRGB::Aqua, CRGB::White);
+// CRGBPalette16(CRGB::Black, CRGB::Blue, CRGB::Aqua, CRGB::White), kept as
+// its four stops so it can stay in flash like the others
+const uint32_t IceColors_4[4] FL_PROGMEM = { CRGB::Black, CRGB::Blue, CRGB::Aqua, CRGB::White };
 
 #include "gradientPalettes.h"
 
-const CRGBPalette16 palettes[] = {
-  RainbowColors_p,
-  RainbowStripeColors_p,
-  CloudColors_p,
-  LavaColors_p,
-  OceanColors_p,
-  ForestColors_p,
-  PartyColors_p,
-  HeatColors_p,
-
-  IceColors_p,
-  IcyBlue_p,
-  Snow_p,
-  RedWhite_p,
-  BlueWhite_p,
-  FairyLight_p,
-  RetroC9_p,
-  RedGreenWhite_p,
-  Holly_p,
-
-  Sunset_Real_gp,
-  es_rivendell_15_gp,
-  es_ocean_breeze_036_gp,
-  rgi_15_gp,
-  retro2_16_gp,
-  Analogous_1_gp,
-  es_pinksplash_08_gp,
-  Coral_reef_gp,
-  es_ocean_breeze_068_gp,
-  es_pinksplash_07_gp,
-  es_vintage_01_gp,
-  departure_gp,
-  es_landscape_64_gp,
-  es_landscape_33_gp,
-  rainbowsherbet_gp,
-  gr65_hult_gp,
-  gr64_hult_gp,
-  GMT_drywet_gp,
-  ib_jul01_gp,
-  es_vintage_57_gp,
-  ib15_gp,
-  Fuschia_7_gp,
-  es_emerald_dragon_08_gp,
-  lava_gp,
-  fire_gp,
-  Colorfull_gp,
-  Magenta_Evening_gp,
-  Pink_Purple_gp,
-  es_autumn_19_gp,
-  BlacK_Blue_Magenta_White_gp,
-  BlacK_Magenta_Red_gp,
-  BlacK_Red_Magenta_Yellow_gp,
-  Blue_Cyan_Yellow_gp,
+// Palettes stay in flash in whatever form they were written in and are only
+// expanded to a CRGBPalette16 when something asks for one, see getPalette().
+enum PaletteKind : uint8_t
+{
+  ProgmemPalette,   // TProgmemRGBPalette16, 16 packed colors
+  GradientPalette,  // DEFINE_GRADIENT_PALETTE bytes
+  FourColorPalette, // four stops, spread the way CRGBPalette16(c1, c2, c3, c4) does
+};
+
+struct PaletteSource
+{
+  const char *name;
+  PaletteKind kind;
+  const void *data;
 };
 
-const uint8_t paletteCount = ARRAY_SIZE(palettes);
-
-const String paletteNames[paletteCount] = {
-  "Rainbow",
-  "Rainbow Stripe",
-  "Cloud",
-  "Lava",
-  "Ocean",
-  "Forest",
-  "Party",
-  "Heat",
-
-  "Ice",
-  "Icy Blue",
-  "Snow",
-  "Red & White",
-  "Blue & White",
-  "Fairy",
-  "Retro C9",
-  "Red, Green & White",
-  "Holly",
-
-  "Sunset_Real",
-  "es_rivendell_15",
-  "es_ocean_breeze_036",
-  "rgi_15",
-  "retro2_16",
-  "Analogous_1",
-  "es_pinksplash_08",
-  "Coral_reef",
-  "es_ocean_breeze_068",
-  "es_pinksplash_07",
-  "es_vintage_01",
-  "departure",
-  "es_landscape_64",
-  "es_landscape_33",
-  "rainbowsherbet",
-  "gr65_hult",
-  "gr64_hult",
-  "GMT_drywet",
-  "ib_jul01",
-  "es_vintage_57",
-  "ib15",
-  "Fuschia_7",
-  "es_emerald_dragon_08",
-  "lava",
-  "fire",
-  "Colorfull",
-  "Magenta_Evening",
-  "Pink_Purple",
-  "es_autumn_19",
-  "BlacK_Blue_Magenta_White",
-  "BlacK_Magenta_Red",
-  "BlacK_Red_Magenta_Yellow",
-  "Blue_Cyan_Yellow",
+constexpr PaletteSource paletteSources[] = {
+  { "Rainbow",                    ProgmemPalette,    RainbowColors_p },
+  { "Rainbow Stripe",             ProgmemPalette,    RainbowStripeColors_p },
+  { "Cloud",                      ProgmemPalette,    CloudColors_p },
+  { "Lava",                       ProgmemPalette,    LavaColors_p },
+  { "Ocean",                      ProgmemPalette,    OceanColors_p },
+  { "Forest",                     ProgmemPalette,    ForestColors_p },
+  { "Party",                      ProgmemPalette,    PartyColors_p },
+  { "Heat",                       ProgmemPalette,    HeatColors_p },
+
+  { "Ice",                        FourColorPalette,  IceColors_4 },
+  { "Icy Blue",                   ProgmemPalette,    IcyBlue_p },
+  { "Snow",                       ProgmemPalette,    Snow_p },
+  { "Red & White",                ProgmemPalette,    RedWhite_p },
+  { "Blue & White",               ProgmemPalette,    BlueWhite_p },
+  { "Fairy",                      ProgmemPalette,    FairyLight_p },
+  { "Retro C9",                   ProgmemPalette,    RetroC9_p },
+  { "Red, Green & White",         ProgmemPalette,    RedGreenWhite_p },
+  { "Holly",                      ProgmemPalette,    Holly_p },
+
+  { "Sunset_Real",                GradientPalette,   Sunset_Real_gp },
+  { "es_rivendell_15",            GradientPalette,   es_rivendell_15_gp },
+  { "es_ocean_breeze_036",        GradientPalette,   es_ocean_breeze_036_gp },
+  { "rgi_15",                     GradientPalette,   rgi_15_gp },
+  { "retro2_16",                  GradientPalette,   retro2_16_gp },
+  { "Analogous_1",                GradientPalette,   Analogous_1_gp },
+  { "es_pinksplash_08",           GradientPalette,   es_pinksplash_08_gp },
+  { "Coral_reef",                 GradientPalette,   Coral_reef_gp },
+  { "es_ocean_breeze_068",        GradientPalette,   es_ocean_breeze_068_gp },
+  { "es_pinksplash_07",           GradientPalette,   es_pinksplash_07_gp },
+  { "es_vintage_01",              GradientPalette,   es_vintage_01_gp },
+  { "departure",                  GradientPalette,   departure_gp },
+  { "es_landscape_64",            GradientPalette,   es_landscape_64_gp },
+  { "es_landscape_33",            GradientPalette,   es_landscape_33_gp },
+  { "rainbowsherbet",             GradientPalette,   rainbowsherbet_gp },
+  { "gr65_hult",                  GradientPalette,   gr65_hult_gp },
+  { "gr64_hult",                  GradientPalette,   gr64_hult_gp },
+  { "GMT_drywet",                 GradientPalette,   GMT_drywet_gp },
+  { "ib_jul01",                   GradientPalette,   ib_jul01_gp },
+  { "es_vintage_57",              GradientPalette,   es_vintage_57_gp },
+  { "ib15",                       GradientPalette,   ib15_gp },
+  { "Fuschia_7",                  GradientPalette,   Fuschia_7_gp },
+  { "es_emerald_dragon_08",       GradientPalette,   es_emerald_dragon_08_gp },
+  { "lava",                       GradientPalette,   lava_gp },
+  { "fire",                       GradientPalette,   fire_gp },
+  { "Colorfull",                  GradientPalette,   Colorfull_gp },
+  { "Magenta_Evening",            GradientPalette,   Magenta_Evening_gp },
+  { "Pink_Purple",                GradientPalette,   Pink_Purple_gp },
+  { "es_autumn_19",               GradientPalette,   es_autumn_19_gp },
+  { "BlacK_Blue_Magenta_White",   GradientPalette,   BlacK_Blue_Magenta_White_gp },
+  { "BlacK_Magenta_Red",          GradientPalette,   BlacK_Magenta_Red_gp },
+  { "BlacK_Red_Magenta_Yellow",   GradientPalette,   BlacK_Red_Magenta_Yellow_gp },
+  { "Blue_Cyan_Yellow",           GradientPalette,   Blue_Cyan_Yellow_gp },
 };
 
+constexpr uint8_t paletteCount = ARRAY_SIZE(paletteSources);
+
+CRGBPalette16 fourColorPalette(const uint32_t *stops)
+{
+  return CRGBPalette16(CRGB(stops[0]), CRGB(stops[1]), CRGB(stops[2]), CRGB(stops[3]));
+}
+
+void decodePalette(uint8_t index, CRGBPalette16 &palette)
+{
+  const PaletteSource &source = paletteSources[index];
+  switch (source.kind)
+  {
+  case ProgmemPalette:
+    palette = *(const TProgmemRGBPalette16 *)source.data;
+    break;
+  case GradientPalette:
+    palette = (TProgmemRGBGradientPalettePtr)source.data;
+    break;
+  case FourColorPalette:
+    palette = fourColorPalette((const uint32_t *)source.data);
+    break;
+  }
+}
+
+// Decoded palettes, least recently used first out. Room for the selected
+// palette, one per segment and a spare.
+#define PALETTE_CACHE_SIZE 6
+
+struct PaletteCacheEntry
+{
+  uint8_t index;     // into paletteSources
+  uint32_t lastUsed; // 0 while the entry is empty
+  CRGBPalette16 palette;
+};
+
+PaletteCacheEntry paletteCache[PALETTE_CACHE_SIZE];
+uint32_t paletteCacheClock = 0;
+
+// The reference is only good until the next call, copy what you keep. The
+// cache isn't locked, so only call this from the loop (or setup()): web
+// requests change currentPaletteIndex and updatePaletteLUTs() follows it.
+const CRGBPalette16 &getPalette(uint8_t index)
+{
+  index = min(index, (uint8_t)(paletteCount - 1));
+
+  PaletteCacheEntry *oldest = &paletteCache[0];
+  for (uint8_t i = 0; i < PALETTE_CACHE_SIZE; i++)
+  {
+    PaletteCacheEntry &entry = paletteCache[i];
+    if (entry.lastUsed && entry.index == index)
+    {
+      entry.lastUsed = ++paletteCacheClock;
+      return entry.palette;
+    }
+    if (entry.lastUsed < oldest->lastUsed)
+      oldest = &entry;
+  }
+
+  decodePalette(index, oldest->palette);
+  oldest->index = index;
+  oldest->lastUsed = ++paletteCacheClock;
+  return oldest->palette;
+}
+
 CRGBPalette16 currentPalette( CRGB::Black);
-CRGBPalette16 targetPalette( palettes[0] );
+CRGBPalette16 targetPalette( CRGB::Black);
+uint8_t targetPaletteIndex = 0;       // currentPaletteIndex targetPalette was taken from
+
+// ColorFromPalette() blends two of the sixteen entries for every pixel it
+// colors. A PaletteLUT holds all 256 blended colors, so a pattern's inner
+// loop is one table load and, at most, a brightness scale. The table only
+// changes where its source palette changed: block b holds the 16 colors
+// between entries b and b + 1, and only blocks touching a changed entry are
+// marked dirty and rebuilt.
+#define PALETTE_LUT_BLOCKS 16
+// a blend step touches every entry, so spread its rebuild over a few frames
+#define PALETTE_LUT_BLOCKS_PER_FRAME 4
+
+struct PaletteLUT
+{
+  CRGB entries[256];
+  CRGBPalette16 source; // the palette entries[] is built from
+  uint16_t dirty;       // one bit per block still to rebuild
+};
+
+// Points lut at palette, marking the blocks around changed entries dirty.
+void setPaletteLUTSource(PaletteLUT &lut, const CRGBPalette16 &palette)
+{
+  for (uint8_t i = 0; i < 16; i++)
+  {
+    if (lut.source.entries[i] != palette.entries[i])
+    {
+      lut.source.entries[i] = palette.entries[i];
+      lut.dirty |= (1 << i) | (1 << ((i + 15) & 15));
+    }
+  }
+}
+
+// Rebuilds up to `blocks` dirty blocks.
+void refreshPaletteLUT(PaletteLUT &lut, uint8_t blocks = PALETTE_LUT_BLOCKS)
+{
+  for (uint8_t block = 0; block < PALETTE_LUT_BLOCKS && lut.dirty && blocks; block++)
+  {
+    if (!(lut.dirty & (1 << block)))
+      continue;
+
+    for (uint16_t i = block * 16; i < block * 16 + 16; i++)
+    {
+      lut.entries[i] = ColorFromPalette(lut.source, i);
+    }
+    lut.dirty &= ~(1 << block);
+    blocks--;
+  }
+}
+
+void buildPaletteLUT(PaletteLUT &lut, const CRGBPalette16 &palette)
+{
+  lut.source = palette;
+  lut.dirty = 0xFFFF;
+  refreshPaletteLUT(lut);
+}
+
+// Same as ColorFromPalette(lut.source, index, brightness), rounding included.
+inline CRGB paletteColor(const PaletteLUT &lut, uint8_t index, uint8_t brightness = 255)
+{
+  CRGB color = lut.entries[index];
+  if (brightness == 255)
+    return color;
+  if (brightness == 0)
+    return CRGB::Black;
+
+  brightness++;
+  for (uint8_t c = 0; c < 3; c++)
+  {
+    if (color.raw[c])
+    {
+      color.raw[c] = scale8(color.raw[c], brightness);
+#if !(FASTLED_SCALE8_FIXED == 1)
+      color.raw[c]++;
+#endif
+    }
+  }
+  return color;
+}
+
+// Same as ColorFromPalette(lut.source, index, brightness, NOBLEND): the
+// first color of each block is an unblended palette entry.
+inline CRGB paletteColorNoBlend(const PaletteLUT &lut, uint8_t index, uint8_t brightness = 255)
+{
+  return paletteColor(lut, index & 0xF0, brightness);
+}
+
+PaletteLUT paletteLUT;        // getPalette(currentPaletteIndex)
+PaletteLUT blendedPaletteLUT; // currentPalette
+
+// Heat (0-255) straight to a color for Fire and Water, with Fire2012's
+// scale8(heat, 190) folded in.
+CRGB fireHeatColors[256];
+CRGB waterHeatColors[256];
+
+void buildHeatColors(CRGB *heatColors, const CRGBPalette16 &palette)
+{
+  for (uint16_t heat = 0; heat < 256; heat++)
+  {
+    heatColors[heat] = ColorFromPalette(palette, scale8(heat, 190));
+  }
+}
+
+void setupPalettes()
+{
+  targetPalette = getPalette(currentPaletteIndex);
+  targetPaletteIndex = currentPaletteIndex;
+
+  buildPaletteLUT(paletteLUT, getPalette(currentPaletteIndex));
+  buildPaletteLUT(blendedPaletteLUT, currentPalette);
+  buildHeatColors(fireHeatColors, HeatColors_p);
+  buildHeatColors(waterHeatColors, fourColorPalette(IceColors_4));
+}
+
+// Once per frame, before rendering. A palette change swaps the whole
+// table at once and starts the blend toward it; the blend is rebuilt a few
+// blocks at a time.
+void updatePaletteLUTs()
+{
+  uint8_t paletteIndex = currentPaletteIndex;
+  const CRGBPalette16 &palette = getPalette(paletteIndex);
+  if (paletteIndex != targetPaletteIndex)
+  {
+    targetPalette = palette;
+    targetPaletteIndex = paletteIndex;
+  }
+  setPaletteLUTSource(paletteLUT, palette);
+  refreshPaletteLUT(paletteLUT);
+  setPaletteLUTSource(blendedPaletteLUT, currentPalette);
+  refreshPaletteLUT(blendedPaletteLUT, PALETTE_LUT_BLOCKS_PER_FRAME);
+}
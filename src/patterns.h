@@ -22,14 +22,40 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <new>
+
 #include "palettes.h"
-#include "twinkleFox.h"
 
-void rainbow(CRGB *leds, uint16_t count)
+// Everything a pattern gets for one frame.
+struct PatternFrame
 {
-  // FastLED's built-in rainbow generator
-  fill_rainbow(leds, count, gHue, speed);
-}
+  CRGB *leds;
+  uint16_t count;
+  uint16_t dt;                          // ms since this instance last rendered, 0 after reset()
+  uint8_t speed;
+  uint8_t hue;                          // slowly rotating base color, gHue
+  const PaletteLUT *palette;            // the selected palette
+  const PaletteLUT *blendedPalette;     // currentPalette, blending toward the selected one
+  uint8_t stride;                       // partial renders update leds[phase], leds[phase + stride], ...
+  uint8_t phase;                        // stride 1, phase 0 for a full frame
+};
+
+// A pattern keeps whatever state it needs in its own members, so several
+// instances can render side by side (transitions, segments) without sharing
+// anything. Instances live in the pattern arena below, never on the heap.
+class Pattern
+{
+public:
+  virtual ~Pattern() {}
+  // called once after construction and whenever the instance restarts
+  virtual void reset() {}
+  virtual void render(const PatternFrame &frame) = 0;
+  // true if render() honours frame.stride/phase, so an over budget pattern
+  // can spread one frame's work over several frames instead of skipping them
+  virtual bool partialRender() const { return false; }
+};
+
+#include "twinkleFox.h"
 
 void addGlitter(CRGB *leds, uint16_t count, fract8 chanceOfGlitter)
 {
@@ -39,266 +65,520 @@ void addGlitter(CRGB *leds, uint16_t count, fract8 chanceOfGlitter)
   }
 }
 
-void rainbowWithGlitter(CRGB *leds, uint16_t count)
+class Rainbow : public Pattern
 {
-  // built-in FastLED rainbow, plus some random sparkly glitter
-  rainbow(leds, count);
-  addGlitter(leds, count, 80);
-}
+public:
+  void render(const PatternFrame &frame) override
+  {
+    // FastLED's built-in rainbow generator
+    fill_rainbow(frame.leds, frame.count, frame.hue, frame.speed);
+  }
+};
 
-void confetti(CRGB *leds, uint16_t count)
+class RainbowWithGlitter : public Rainbow
 {
-  // random colored speckles that blink in and fade smoothly
-  fadeToBlackBy(leds, count, 10);
-  int pos = random16(count);
-  leds[pos] += CHSV(gHue + random8(64), 200, 255);
-}
+public:
+  void render(const PatternFrame &frame) override
+  {
+    // built-in FastLED rainbow, plus some random sparkly glitter
+    Rainbow::render(frame);
+    addGlitter(frame.leds, frame.count, 80);
+  }
+};
 
-void sinelon(CRGB *leds, uint16_t count)
+class Confetti : public Pattern
 {
-  // a colored dot sweeping back and forth, with fading trails
-  fadeToBlackBy(leds, count, 20);
-  int pos = beatsin16(speed, 0, count - 1);
-  static int prevpos = 0;
-  CRGB color = ColorFromPalette(palettes[currentPaletteIndex], gHue, 255);
-  if (pos < prevpos)
+public:
+  void render(const PatternFrame &frame) override
   {
-    fill_solid(leds + pos, (prevpos - pos) + 1, color);
+    // random colored speckles that blink in and fade smoothly
+    fadeToBlackBy(frame.leds, frame.count, 10);
+    int pos = random16(frame.count);
+    frame.leds[pos] += CHSV(frame.hue + random8(64), 200, 255);
   }
-  else
+};
+
+class Sinelon : public Pattern
+{
+public:
+  void reset() override
   {
-    fill_solid(leds + prevpos, (pos - prevpos) + 1, color);
+    prevpos = 0;
+  }
+
+  void render(const PatternFrame &frame) override
+  {
+    // a colored dot sweeping back and forth, with fading trails
+    fadeToBlackBy(frame.leds, frame.count, 20);
+    int pos = beatsin16(frame.speed, 0, frame.count - 1);
+    CRGB color = paletteColor(*frame.palette, frame.hue);
+    // the span shrank (segment edit) since the last frame
+    if (prevpos >= frame.count)
+      prevpos = pos;
+    if (pos < prevpos)
+    {
+      fill_solid(frame.leds + pos, (prevpos - pos) + 1, color);
+    }
+    else
+    {
+      fill_solid(frame.leds + prevpos, (pos - prevpos) + 1, color);
+    }
+    prevpos = pos;
   }
-  prevpos = pos;
-}
 
-void bpm(CRGB *leds, uint16_t count)
+private:
+  int prevpos;
+};
+
+class Bpm : public Pattern
 {
-  // colored stripes pulsing at a defined Beats-Per-Minute (BPM)
-  uint8_t beat = beatsin8(speed, 64, 255);
-  CRGBPalette16 palette = palettes[currentPaletteIndex];
-  for (int i = 0; i < count; i++)
+public:
+  void render(const PatternFrame &frame) override
   {
-    leds[i] = ColorFromPalette(palette, gHue + (i * 2), beat - gHue + (i * 10));
+    // colored stripes pulsing at a defined Beats-Per-Minute (BPM)
+    uint8_t beat = beatsin8(frame.speed, 64, 255);
+    for (int i = 0; i < frame.count; i++)
+    {
+      frame.leds[i] = paletteColor(*frame.palette, frame.hue + (i * 2), beat - frame.hue + (i * 10));
+    }
   }
-}
+};
 
-void juggle(CRGB *leds, uint16_t count)
+class Juggle : public Pattern
 {
-  // eight colored dots, weaving in and out of sync with each other
-  fadeToBlackBy(leds, count, 20);
-  byte dothue = 0;
-  for (int i = 0; i < 8; i++)
+public:
+  void render(const PatternFrame &frame) override
   {
-    leds[beatsin16(i + speed, 0, count - 1)] |= CHSV(dothue, 200, 255);
-    dothue += 32;
+    // eight colored dots, weaving in and out of sync with each other
+    fadeToBlackBy(frame.leds, frame.count, 20);
+    byte dothue = 0;
+    for (int i = 0; i < 8; i++)
+    {
+      frame.leds[beatsin16(i + frame.speed, 0, frame.count - 1)] |= CHSV(dothue, 200, 255);
+      dothue += 32;
+    }
   }
-}
+};
 
-void showSolidColor(CRGB *leds, uint16_t count)
+class SolidColor : public Pattern
 {
-  fill_solid(leds, count, solidColor);
-}
+public:
+  void render(const PatternFrame &frame) override
+  {
+    fill_solid(frame.leds, frame.count, solidColor);
+  }
+};
 
 // based on FastLED example Fire2012WithPalette: https://github.com/FastLED/FastLED/blob/master/examples/Fire2012WithPalette/Fire2012WithPalette.ino
-void heatMap(CRGB *leds, uint16_t count, CRGBPalette16 palette, bool up)
+// The leds are split into `flames` columns that burn independently, every
+// other one from the far end, so two flames on a pair of skates burn from the
+// toe and the heel. Cooling noise comes four cells to a PRNG draw and heat
+// maps straight to a color through a table, so the cost per led is flat.
+class HeatMap : public Pattern
 {
-  fill_solid(leds, count, CRGB::Black);
-
-  // Add entropy to random number generator; we use a lot of it.
-  random16_add_entropy(random(256));
+public:
+  HeatMap(const CRGB *heatColors, bool up) : heatColors(heatColors), up(up) {}
 
-  // Array of temperature readings at each simulation cell
-  static byte heat[SKATE_LED_LENGTH * 2];
-
-  byte colorindex;
-
-  // Step 1.  Cool down every cell a little
-  for (uint16_t i = 0; i < NUM_LEDS; i++)
+  void reset() override
   {
-    heat[i] = qsub8(heat[i], random8(0, ((cooling * 10) / count) + 2));
+    memset(heat, 0, sizeof(heat));
+    noise = ((uint32_t)random16() << 16) | random16() | 1; // xorshift never leaves 0
   }
 
-  // Step 2.  Heat from each cell drifts 'up' and diffuses a little
-  for (uint16_t k = NUM_LEDS - 1; k >= 2; k--)
+  void render(const PatternFrame &frame) override
   {
-    heat[k] = (heat[k - 1] + heat[k - 2] + heat[k - 2]) / 3;
+    uint16_t count = min(frame.count, (uint16_t)ARRAY_SIZE(heat));
+
+    fill_solid(frame.leds, frame.count, CRGB::Black);
+
+    // Add entropy to random number generator; we use a lot of it.
+    random16_add_entropy(random(256));
+
+    uint8_t columns = constrain(flames, 1, FLAMES_MAX);
+    uint16_t length = count / columns;
+    if (length == 0)
+    {
+      columns = 1;
+      length = count;
+    }
+
+    for (uint8_t c = 0; c < columns; c++)
+    {
+      uint16_t start = c * length;
+      // the last column takes whatever doesn't divide evenly
+      uint16_t columnLength = c == columns - 1 ? count - start : length;
+      renderColumn(frame.leds + start, heat + start, columnLength, (c & 1) ? !up : up);
+    }
   }
 
-  // Step 3.  Randomly ignite new 'sparks' of heat near the bottom
-  if (random8() < sparking)
+private:
+  uint32_t nextNoise()
   {
-    int y = random8(7);
-    heat[y] = qadd8(heat[y], random8(160, 255));
+    // xorshift32: four usable bytes per draw
+    noise ^= noise << 13;
+    noise ^= noise >> 17;
+    noise ^= noise << 5;
+    return noise;
   }
 
-  // Step 4.  Map from heat cells to LED colors
-  for (uint16_t j = 0; j < NUM_LEDS; j++)
+  void renderColumn(CRGB *leds, byte *heat, uint16_t length, bool up)
   {
-    // Scale the heat value from 0-255 down to 0-240
-    // for best results with color palettes.
-    colorindex = scale8(heat[j], 190);
+    if (length == 0)
+      return;
 
-    CRGB color = ColorFromPalette(palette, colorindex);
+    // Step 1.  Cool down every cell a little
+    uint16_t coolingLimit = min(((cooling * 10) / length) + 2, 256);
+    for (uint16_t i = 0; i < length; i += 4)
+    {
+      uint32_t r = nextNoise();
+      for (uint16_t j = i; j < i + 4 && j < length; j++, r >>= 8)
+      {
+        // same as random8(0, coolingLimit)
+        heat[j] = qsub8(heat[j], ((r & 0xFF) * coolingLimit) >> 8);
+      }
+    }
 
-    if (up)
+    // Step 2.  Heat from each cell drifts 'up' and diffuses a little
+    for (uint16_t k = length - 1; k >= 2; k--)
     {
-      leds[j] = color;
+      heat[k] = (heat[k - 1] + heat[k - 2] + heat[k - 2]) / 3;
     }
-    else
+
+    // Step 3.  Randomly ignite new 'sparks' of heat near the bottom
+    if (random8() < sparking)
     {
-      leds[(count - 1) - j] = color;
+      int y = random8(min(length, (uint16_t)7));
+      heat[y] = qadd8(heat[y], random8(160, 255));
+    }
+
+    // Step 4.  Map from heat cells to LED colors
+    for (uint16_t j = 0; j < length; j++)
+    {
+      leds[up ? j : (length - 1) - j] = heatColors[heat[j]];
     }
   }
-}
 
-void fire(CRGB *leds, uint16_t count)
-{
-  heatMap(leds, count, HeatColors_p, true);
-}
+  const CRGB *heatColors;
+  bool up;
+  uint32_t noise;
+  // Array of temperature readings at each simulation cell
+  byte heat[SKATE_LED_LENGTH * 2];
+};
 
-void water(CRGB *leds, uint16_t count)
+class Fire : public HeatMap
 {
-  heatMap(leds, count, IceColors_p, false);
-}
+public:
+  Fire() : HeatMap(fireHeatColors, true) {}
+};
 
-// Pride2015 by Mark Kriegsman: https://gist.github.com/kriegsman/964de772d64c502760e5
-// This function draws rainbows with an ever-changing,
-// widely-varying set of parameters.
-void pride(CRGB *leds, uint16_t count)
+class Water : public HeatMap
 {
-  static uint16_t sPseudotime = 0;
-  static uint16_t sLastMillis = 0;
-  static uint16_t sHue16 = 0;
-
-  uint8_t sat8 = beatsin88(87, 220, 250);
-  uint8_t brightdepth = beatsin88(341, 96, 224);
-  uint16_t brightnessthetainc16 = beatsin88(203, (25 * 256), (40 * 256));
-  uint8_t msmultiplier = beatsin88(147, 23, 60);
-
-  uint16_t hue16 = sHue16; //gHue * 256;
-  uint16_t hueinc16 = beatsin88(113, 1, 3000);
-
-  uint16_t ms = millis();
-  uint16_t deltams = ms - sLastMillis;
-  sLastMillis = ms;
-  sPseudotime += deltams * msmultiplier;
-  sHue16 += deltams * beatsin88(400, 5, 9);
-  uint16_t brightnesstheta16 = sPseudotime;
-
-  for (uint16_t i = 0; i < count; i++)
-  {
-    hue16 += hueinc16;
-    uint8_t hue8 = hue16 / 256;
-
-    brightnesstheta16 += brightnessthetainc16;
-    uint16_t b16 = sin16(brightnesstheta16) + 32768;
-
-    uint16_t bri16 = (uint32_t)((uint32_t)b16 * (uint32_t)b16) / 65536;
-    uint8_t bri8 = (uint32_t)(((uint32_t)bri16) * brightdepth) / 65536;
-    bri8 += (255 - brightdepth);
-
-    CRGB newcolor = CHSV(hue8, sat8, bri8);
+public:
+  Water() : HeatMap(waterHeatColors, false) {}
+};
 
-    uint16_t pixelnumber = i;
-    pixelnumber = (count - 1) - pixelnumber;
+// ((sin16(theta) + 32768)^2) >> 16 at every 64th theta, the brightness wave
+// under pride and colorwaves. Looking it up instead of computing it per pixel
+// is off by at most 1 in the final 8-bit brightness.
+#define SQUARED_SINE_BITS 10
+uint16_t squaredSineTable[1 << SQUARED_SINE_BITS];
+bool squaredSineTableBuilt = false;
 
-    nblend(leds[pixelnumber], newcolor, 64);
+void buildSquaredSineTable()
+{
+  for (uint16_t i = 0; i < ARRAY_SIZE(squaredSineTable); i++)
+  {
+    uint16_t b16 = sin16(i << (16 - SQUARED_SINE_BITS)) + 32768;
+    squaredSineTable[i] = ((uint32_t)b16 * b16) >> 16;
   }
+  squaredSineTableBuilt = true;
 }
 
-// ColorWavesWithPalettes by Mark Kriegsman: https://gist.github.com/kriegsman/8281905786e8b2632aeb
-// This function draws color waves with an ever-changing,
-// widely-varying set of parameters, using a color palette.
-void colorwaves(CRGB *ledarray, uint16_t numleds, CRGBPalette16 &palette)
+// Pride2015 and ColorWavesWithPalettes by Mark Kriegsman are the same wave
+// field: a hue drifting along the strip with a brightness wave rolling
+// through it, each pixel blended into what was there. Only how a hue and
+// brightness become a color differs, so that's the `color` argument.
+class WaveField : public Pattern
 {
-  static uint16_t sPseudotime = 0;
-  static uint16_t sLastMillis = 0;
-  static uint16_t sHue16 = 0;
-
-  // uint8_t sat8 = beatsin88( 87, 220, 250);
-  uint8_t brightdepth = beatsin88(341, 96, 224);
-  uint16_t brightnessthetainc16 = beatsin88(203, (25 * 256), (40 * 256));
-  uint8_t msmultiplier = beatsin88(147, 23, 60);
-
-  uint16_t hue16 = sHue16; //gHue * 256;
-  uint16_t hueinc16 = beatsin88(113, 300, 1500);
-
-  uint16_t ms = millis();
-  uint16_t deltams = ms - sLastMillis;
-  sLastMillis = ms;
-  sPseudotime += deltams * msmultiplier;
-  sHue16 += deltams * beatsin88(400, 5, 9);
-  uint16_t brightnesstheta16 = sPseudotime;
-
-  for (uint16_t i = 0; i < numleds; i++)
+public:
+  void reset() override
   {
-    hue16 += hueinc16;
-    uint8_t hue8 = hue16 / 256;
-    uint16_t h16_128 = hue16 >> 7;
-    if (h16_128 & 0x100)
+    sPseudotime = 0;
+    sHue16 = 0;
+    if (!squaredSineTableBuilt)
     {
-      hue8 = 255 - (h16_128 >> 1);
+      buildSquaredSineTable();
     }
-    else
+  }
+
+protected:
+  template <typename Color>
+  void renderWaves(const PatternFrame &frame, uint16_t hueinc16, uint8_t blendAmount, Color color)
+  {
+    CRGB *leds = frame.leds;
+    uint16_t count = frame.count;
+
+    uint8_t brightdepth = beatsin88(341, 96, 224);
+    uint16_t brightnessthetainc16 = beatsin88(203, (25 * 256), (40 * 256));
+    uint8_t msmultiplier = beatsin88(147, 23, 60);
+
+    uint16_t hue16 = sHue16; //gHue * 256;
+
+    uint16_t deltams = frame.dt;
+    sPseudotime += deltams * msmultiplier;
+    sHue16 += deltams * beatsin88(400, 5, 9);
+    uint16_t brightnesstheta16 = sPseudotime;
+
+    uint8_t brightfloor = 255 - brightdepth;
+
+    for (uint16_t i = 0; i < count; i++)
     {
-      hue8 = h16_128 >> 1;
-    }
+      hue16 += hueinc16;
+      brightnesstheta16 += brightnessthetainc16;
 
-    brightnesstheta16 += brightnessthetainc16;
-    uint16_t b16 = sin16(brightnesstheta16) + 32768;
+      uint16_t bri16 = squaredSineTable[brightnesstheta16 >> (16 - SQUARED_SINE_BITS)];
+      uint8_t bri8 = (((uint32_t)bri16 * brightdepth) >> 16) + brightfloor;
 
-    uint16_t bri16 = (uint32_t)((uint32_t)b16 * (uint32_t)b16) / 65536;
-    uint8_t bri8 = (uint32_t)(((uint32_t)bri16) * brightdepth) / 65536;
-    bri8 += (255 - brightdepth);
+      nblend(leds[(count - 1) - i], color(hue16, bri8), blendAmount);
+    }
+  }
 
-    uint8_t index = hue8;
-    //index = triwave8( index);
-    index = scale8(index, 240);
+private:
+  uint16_t sPseudotime;
+  uint16_t sHue16;
+};
 
-    CRGB newcolor = ColorFromPalette(palette, index, bri8);
+// Pride2015 by Mark Kriegsman: https://gist.github.com/kriegsman/964de772d64c502760e5
+// This function draws rainbows with an ever-changing,
+// widely-varying set of parameters.
+class Pride : public WaveField
+{
+public:
+  void render(const PatternFrame &frame) override
+  {
+    uint8_t sat8 = beatsin88(87, 220, 250);
+    uint16_t hueinc16 = beatsin88(113, 1, 3000);
 
-    uint16_t pixelnumber = i;
-    pixelnumber = (numleds - 1) - pixelnumber;
+    renderWaves(frame, hueinc16, 64, [sat8](uint16_t hue16, uint8_t bri8) {
+      return CRGB(CHSV(hue16 / 256, sat8, bri8));
+    });
+  }
+};
 
-    nblend(ledarray[pixelnumber], newcolor, 128);
+// ColorWavesWithPalettes by Mark Kriegsman: https://gist.github.com/kriegsman/8281905786e8b2632aeb
+// This function draws color waves with an ever-changing,
+// widely-varying set of parameters, using a color palette.
+class ColorWaves : public WaveField
+{
+public:
+  void render(const PatternFrame &frame) override
+  {
+    const PaletteLUT &palette = *frame.blendedPalette;
+    uint16_t hueinc16 = beatsin88(113, 300, 1500);
+
+    renderWaves(frame, hueinc16, 128, [&palette](uint16_t hue16, uint8_t bri8) {
+      // hue folds back on itself instead of wrapping around the palette
+      uint16_t h16_128 = hue16 >> 7;
+      uint8_t hue8 = (h16_128 & 0x100) ? 255 - (h16_128 >> 1) : h16_128 >> 1;
+      return paletteColor(palette, scale8(hue8, 240), bri8);
+    });
   }
-}
+};
+
+typedef Pattern *(*PatternFactory)(void *memory);
 
-void colorWaves(CRGB *leds, uint16_t count)
+template <class T>
+Pattern *createPattern(void *memory)
 {
-  colorwaves(leds, count, currentPalette);
+  return new (memory) T();
 }
 
-typedef void (*Pattern)(CRGB *leds, uint16_t count);
-typedef Pattern PatternList[];
 typedef struct
 {
-  Pattern pattern;
-  String name;
-} PatternAndName;
-typedef PatternAndName PatternAndNameList[];
+  const char *name;
+  size_t size;
+  PatternFactory create;
+} PatternInfo;
+
+#define PATTERN_INFO(T, name) { name, sizeof(T), createPattern<T> }
 
-PatternAndNameList patterns = {
-    {pride, "Pride"},
-    {colorWaves, "Color Waves"},
+constexpr PatternInfo patterns[] = {
+    PATTERN_INFO(Pride, "Pride"),
+    PATTERN_INFO(ColorWaves, "Color Waves"),
 
     // TwinkleFOX patterns
-    {drawTwinkles, "Twinkles"},
+    PATTERN_INFO(Twinkles, "Twinkles"),
 
     // Fire & Water
-    {fire, "Fire"},
-    {water, "Water"},
+    PATTERN_INFO(Fire, "Fire"),
+    PATTERN_INFO(Water, "Water"),
 
     // DemoReel100 patterns
-    {rainbow, "rainbow"},
-    {rainbowWithGlitter, "rainbowWithGlitter"},
-    {confetti, "confetti"},
-    {sinelon, "sinelon"},
-    {juggle, "juggle"},
-    {bpm, "bpm"},
-
-    {showSolidColor, "Solid Color"},
+    PATTERN_INFO(Rainbow, "rainbow"),
+    PATTERN_INFO(RainbowWithGlitter, "rainbowWithGlitter"),
+    PATTERN_INFO(Confetti, "confetti"),
+    PATTERN_INFO(Sinelon, "sinelon"),
+    PATTERN_INFO(Juggle, "juggle"),
+    PATTERN_INFO(Bpm, "bpm"),
+
+    PATTERN_INFO(SolidColor, "Solid Color"),
 };
 
 const uint8_t patternCount = ARRAY_SIZE(patterns);
+
+constexpr size_t largestPatternSize(size_t i = 0)
+{
+  return i == ARRAY_SIZE(patterns) ? 0 : max(patterns[i].size, largestPatternSize(i + 1));
+}
+
+// Segments (segments.h) each run their own pattern instance
+#ifndef SEGMENT_MAX
+#define SEGMENT_MAX 4
+#endif
+
+// Pattern arena: PATTERN_SLOTS fixed slots, each big enough for the largest
+// pattern, sized at build time. A slot holds one live pattern instance. Slots
+// 0 and 1 run the whole strip pattern and, during a transition, the outgoing
+// one; the rest belong to segments.
+#define PATTERN_SLOTS (2 + SEGMENT_MAX)
+#define SEGMENT_PATTERN_SLOT(segment) (2 + (segment))
+#define PATTERN_STATE_SIZE largestPatternSize()
+
+// CPU budget: each instance's render cost is kept as a rolling average of
+// cycles per full frame, per slot, since a segment instance covers fewer
+// leds than the whole strip one. One that averages more than
+// PATTERN_BUDGET_PERCENT of a frame is degraded: partial renderers update
+// 1/divider of their pixels each frame, the rest render every divider-th
+// frame and hold in between, with dt covering the skipped time so they keep
+// their speed. Holding a frame longer than that shows as stutter, so those
+// stop at PATTERN_MAX_HELD_DIVIDER.
+#ifndef PATTERN_BUDGET_PERCENT
+#define PATTERN_BUDGET_PERCENT 50
+#endif
+#define PATTERN_MAX_DIVIDER 4
+#define PATTERN_MAX_HELD_DIVIDER 2
+
+typedef struct
+{
+  uint32_t cycles;                      // rolling average, 1/8 weight per sample
+  uint8_t divider;                      // 1, 2 or PATTERN_MAX_DIVIDER; 0 until first measured
+} PatternBudget;
+
+typedef struct
+{
+  Pattern *pattern;
+  uint8_t patternIndex;
+  unsigned long lastRenderMillis;
+  uint8_t frames;                       // frame counter for budget.divider
+  PatternBudget budget;
+  alignas(8) uint8_t memory[PATTERN_STATE_SIZE];
+} PatternSlot;
+
+PatternSlot patternSlots[PATTERN_SLOTS];
+
+// Makes `slot` hold a fresh instance of patterns[patternIndex].
+Pattern *startPattern(uint8_t slot, uint8_t patternIndex)
+{
+  PatternSlot &s = patternSlots[slot];
+  if (s.pattern)
+  {
+    s.pattern->~Pattern();
+  }
+  s.pattern = patterns[patternIndex].create(s.memory);
+  s.patternIndex = patternIndex;
+  s.lastRenderMillis = 0;
+  s.frames = 0;
+  s.budget = PatternBudget();
+  s.pattern->reset();
+  return s.pattern;
+}
+
+// A frame for `count` leds using the global speed and palette
+PatternFrame patternFrame(CRGB *leds, uint16_t count)
+{
+  PatternFrame frame;
+  frame.leds = leds;
+  frame.count = count;
+  frame.dt = 0;
+  frame.speed = speed;
+  frame.hue = gHue;
+  frame.palette = &paletteLUT;
+  frame.blendedPalette = &blendedPaletteLUT;
+  frame.stride = 1;
+  frame.phase = 0;
+  return frame;
+}
+
+// Degrades the instance in `s` while it's over its budget, see PatternBudget
+void updatePatternBudget(PatternSlot &s, uint32_t cycles, uint8_t maxDivider)
+{
+  static const uint32_t cpuMHz = ESP.getCpuFreqMHz();
+  static const uint32_t budget = cpuMHz * (1000000UL / FRAMES_PER_SECOND) / 100 * PATTERN_BUDGET_PERCENT;
+
+  PatternBudget &b = s.budget;
+  if (!b.divider)
+  {
+    b.cycles = cycles;
+    b.divider = 1;
+  }
+  else
+  {
+    b.cycles = b.cycles - b.cycles / 8 + cycles / 8;
+  }
+
+  uint32_t perFrame = b.cycles / b.divider;
+  if (perFrame > budget && b.divider < maxDivider)
+  {
+    b.divider *= 2;
+    LOG_WARN("Pattern %s in slot %u over budget (%lu of %lu us), rendering 1/%u per frame",
+             patterns[s.patternIndex].name, (unsigned)(&s - patternSlots), (unsigned long)(perFrame / cpuMHz),
+             (unsigned long)(budget / cpuMHz), b.divider);
+  }
+  else if (b.divider > 1 && b.cycles / (b.divider / 2) < budget * 3 / 4)
+  {
+    // hysteresis, so a pattern near the line doesn't flip every frame
+    b.divider /= 2;
+    LOG_INFO("Pattern %s in slot %u back within budget, rendering 1/%u per frame",
+             patterns[s.patternIndex].name, (unsigned)(&s - patternSlots), b.divider);
+  }
+}
+
+// metrics.h
+void countPatternRender(uint8_t patternIndex, uint32_t micros);
+
+// Renders the instance in `slot`, restarting it first if it holds a
+// different pattern. Fills in frame.dt, and frame.stride/phase when the
+// pattern is over budget. A skipped frame leaves frame.leds as last rendered.
+
+void renderPatternSlot(uint8_t slot, uint8_t patternIndex, PatternFrame &frame)
+{
+  PatternSlot &s = patternSlots[slot];
+  if (!s.pattern || s.patternIndex != patternIndex)
+  {
+    startPattern(slot, patternIndex);
+  }
+
+  uint8_t divider = max(s.budget.divider, (uint8_t)1);
+  uint8_t phase = s.frames++ & (divider - 1);
+  bool partial = s.pattern->partialRender();
+  if (phase && !partial)
+  {
+    return;
+  }
+  if (partial)
+  {
+    frame.stride = divider;
+    frame.phase = phase;
+  }
+
+  unsigned long now = millis();
+  frame.dt = s.lastRenderMillis ? min(now - s.lastRenderMillis, 0xFFFFUL) : 0;
+  s.lastRenderMillis = now;
+
+  uint32_t renderStart = ESP.getCycleCount();
+  s.pattern->render(frame);
+  uint32_t cycles = ESP.getCycleCount() - renderStart;
+  countPatternRender(patternIndex, cycles / ESP.getCpuFreqMHz());
+  // a partial render did 1/divider of a frame's work
+  updatePatternBudget(s, partial ? cycles * divider : cycles, partial ? PATTERN_MAX_DIVIDER : PATTERN_MAX_HELD_DIVIDER);
+}
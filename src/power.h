@@ -0,0 +1,104 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Power limiting, done in the output stage instead of by FastLED. FastLED's
+// setMaxPowerInVoltsAndMilliamps() rescans the whole strip inside every
+// show(). Here writeOutput() sums each channel while it writes this skate's
+// pixels anyway, so the estimate and the brightness limit cost O(1) per frame.
+// The limited brightness travels with the frame through the playback buffer,
+// so the frame that would overdraw is the one that gets dimmed.
+
+// Current per led at full channel value, and with the led dark. The defaults
+// are FastLED's WS2812 figures; override them with build flags once a batch
+// has been measured.
+#ifndef POWER_RED_MA
+#define POWER_RED_MA 16
+#endif
+#ifndef POWER_GREEN_MA
+#define POWER_GREEN_MA 11
+#endif
+#ifndef POWER_BLUE_MA
+#define POWER_BLUE_MA 15
+#endif
+#ifndef POWER_DARK_MA
+#define POWER_DARK_MA 1
+#endif
+
+// how far brightness may climb back per frame once the limit eases off;
+// dimming is immediate, so only the recovery is slowed to stop pumping
+#define POWER_RELEASE_STEP 4
+
+uint8_t powerLimitedBrightness = 255;
+uint16_t powerEstimateMilliamps = 0; // this skate's last frame, after limiting
+bool powerLimited = false;
+
+// Brightness for the frame writeOutput(LocalOutput, ...) just wrote. At
+// 16-bit render depth the pixels already include brightness, so this only
+// ever comes down from 255 to limit power.
+uint8_t limitOutputPower()
+{
+#ifdef RENDER_DEPTH_16
+  uint8_t requested = 255;
+#else
+  uint8_t requested = brightness;
+#endif
+
+  uint32_t dark = (uint32_t)SKATE_LED_LENGTH * POWER_DARK_MA;
+  // mA at full brightness, less the dark current
+  uint32_t lit = (outputChannelSums[0] * POWER_RED_MA +
+                  outputChannelSums[1] * POWER_GREEN_MA +
+                  outputChannelSums[2] * POWER_BLUE_MA) / 255;
+  uint32_t budget = (MAX_POWER_CONVERSION);
+  budget = budget > dark ? budget - dark : 0;
+
+  uint8_t target = requested;
+  if (lit * requested / 255 > budget)
+  {
+    target = budget * 255 / lit;
+  }
+
+  powerLimited = target < requested;
+  if (target > powerLimitedBrightness)
+  {
+    target = min(target, (uint8_t)qadd8(powerLimitedBrightness, POWER_RELEASE_STEP));
+  }
+  powerLimitedBrightness = target;
+  powerEstimateMilliamps = min(dark + lit * target / 255, (uint32_t)0xFFFF);
+
+  return target;
+}
+
+String getPowerJson()
+{
+  String json = "{\"milliamps\":";
+  json += powerEstimateMilliamps;
+  json += ",\"budget\":";
+  json += (MAX_POWER_CONVERSION);
+  json += ",\"brightness\":";
+  json += powerLimitedBrightness;
+  json += ",\"limited\":";
+  json += powerLimited ? "true" : "false";
+  json += "}";
+  return json;
+}
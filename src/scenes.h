@@ -0,0 +1,214 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Scene presets: named snapshots of every field value and the segment
+// table, stored in LittleFS. Device fields like stationMode aren't recalled.
+//
+// Each scene is one record file, /scenes/<slot>.bin, holding a settings
+// record header, the tagged field payload (field.h) and the segment table
+// in segments.bin's format. Values are matched by field name on recall, so
+// a scene outlives firmware updates that add or remove fields. /scenes/index
+// maps names to slots and is kept in RAM, so recalling a scene opens exactly
+// one small file. Recalled values go through the field transaction and land
+// between two frames.
+
+#define SCENE_DIRECTORY "/scenes"
+#define SCENE_INDEX_PATH SCENE_DIRECTORY "/index"
+#define SCENE_MAX 16
+#define SCENE_NAME_LENGTH 24
+
+typedef struct scene_index_entry {
+  char name[SCENE_NAME_LENGTH]; // empty when the slot is free
+} scene_index_entry;
+
+scene_index_entry sceneIndex[SCENE_MAX];
+
+void scenePath(uint8_t slot, char *path, size_t length)
+{
+  snprintf(path, length, SCENE_DIRECTORY "/%u.bin", slot);
+}
+
+void loadSceneIndex()
+{
+  memset(sceneIndex, 0, sizeof(sceneIndex));
+
+  File file = SPIFFS.open(SCENE_INDEX_PATH, "r");
+  if (!file)
+    return;
+
+  file.read((uint8_t *)sceneIndex, sizeof(sceneIndex));
+  file.close();
+
+  // never trust a name to be terminated
+  for (uint8_t i = 0; i < SCENE_MAX; i++)
+    sceneIndex[i].name[SCENE_NAME_LENGTH - 1] = 0;
+}
+
+bool writeSceneIndex()
+{
+  File file = SPIFFS.open(SCENE_INDEX_PATH, "w");
+  if (!file)
+    return false;
+
+  size_t written = file.write((const uint8_t *)sceneIndex, sizeof(sceneIndex));
+  file.close();
+  return written == sizeof(sceneIndex);
+}
+
+int8_t findScene(const char *name)
+{
+  for (uint8_t i = 0; i < SCENE_MAX; i++)
+  {
+    if (sceneIndex[i].name[0] && strcmp(sceneIndex[i].name, name) == 0)
+      return i;
+  }
+  return -1;
+}
+
+bool saveScene(const char *name, const FieldTable &table)
+{
+  if (!name[0] || strlen(name) >= SCENE_NAME_LENGTH)
+    return false;
+
+  int8_t slot = findScene(name);
+  if (slot < 0)
+  {
+    for (uint8_t i = 0; i < SCENE_MAX && slot < 0; i++)
+    {
+      if (!sceneIndex[i].name[0])
+        slot = i;
+    }
+  }
+  if (slot < 0)
+    return false;
+
+  uint8_t payload[SETTINGS_PAYLOAD_SIZE];
+  settings_record_header header;
+  header.magic = SETTINGS_MAGIC;
+  header.version = SETTINGS_VERSION;
+  header.layout = fieldLayoutHash(table);
+  header.sequence = 0;
+  header.length = writeFieldsTagged(table, payload, sizeof(payload));
+  header.crc = settingsRecordCrc(header, payload);
+
+  segment_file_header segmentHeader;
+  segmentHeader.magic = SEGMENT_MAGIC;
+  segmentHeader.version = SEGMENT_VERSION;
+  segmentHeader.segmentSize = sizeof(Segment);
+  segmentHeader.count = SEGMENT_MAX;
+  segmentHeader.segmentCount = segmentCount;
+
+  char path[32];
+  scenePath(slot, path, sizeof(path));
+  File file = SPIFFS.open(path, "w");
+  if (!file)
+    return false;
+  file.write((const uint8_t *)&header, sizeof(header));
+  file.write(payload, header.length);
+  file.write((const uint8_t *)&segmentHeader, sizeof(segmentHeader));
+  file.write((const uint8_t *)segments, sizeof(segments));
+  file.close();
+
+  if (strcmp(sceneIndex[slot].name, name) == 0)
+    return true;
+
+  strcpy(sceneIndex[slot].name, name);
+  return writeSceneIndex();
+}
+
+bool recallScene(const char *name, const FieldTable &table)
+{
+  int8_t slot = findScene(name);
+  if (slot < 0)
+    return false;
+
+  char path[32];
+  scenePath(slot, path, sizeof(path));
+  File file = SPIFFS.open(path, "r");
+  if (!file)
+    return false;
+
+  uint8_t payload[SETTINGS_PAYLOAD_SIZE];
+  settings_record_header header;
+  bool valid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+               header.magic == SETTINGS_MAGIC && header.version == SETTINGS_VERSION &&
+               header.length <= sizeof(payload) && file.read(payload, header.length) == header.length &&
+               settingsRecordCrc(header, payload) == header.crc;
+
+  // a segment table that doesn't match this build's is left out
+  segment_file_header segmentHeader;
+  Segment segmentTable[SEGMENT_MAX];
+  memcpy(segmentTable, segments, sizeof(segmentTable));
+  bool haveSegments = valid && file.read((uint8_t *)&segmentHeader, sizeof(segmentHeader)) == sizeof(segmentHeader) &&
+                      segmentHeader.magic == SEGMENT_MAGIC && segmentHeader.version == SEGMENT_VERSION &&
+                      segmentHeader.segmentSize == sizeof(Segment) && segmentHeader.count <= SEGMENT_MAX &&
+                      file.read((uint8_t *)segmentTable, segmentHeader.count * sizeof(Segment)) == segmentHeader.count * sizeof(Segment);
+  file.close();
+
+  if (!valid)
+  {
+    LOG_WARN("Scene %s is stale or corrupt", name);
+    return false;
+  }
+
+  stageFieldsTagged(table, payload, header.length, haveSegments ? segmentTable : NULL);
+  return true;
+}
+
+bool deleteScene(const char *name)
+{
+  int8_t slot = findScene(name);
+  if (slot < 0)
+    return false;
+
+  char path[32];
+  scenePath(slot, path, sizeof(path));
+  SPIFFS.remove(path);
+
+  sceneIndex[slot].name[0] = 0;
+  return writeSceneIndex();
+}
+
+String getScenesJson()
+{
+  String json = "[";
+  for (uint8_t i = 0; i < SCENE_MAX; i++)
+  {
+    if (!sceneIndex[i].name[0])
+      continue;
+    if (json.length() > 1)
+      json += ",";
+    json += "\"";
+    json += sceneIndex[i].name;
+    json += "\"";
+  }
+  json += "]";
+  return json;
+}
+
+void setupScenes()
+{
+  SPIFFS.mkdir(SCENE_DIRECTORY);
+  loadSceneIndex();
+}
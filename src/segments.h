@@ -0,0 +1,196 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Segments: up to SEGMENT_MAX LED ranges, each with its own pattern, palette,
+// speed and brightness, e.g. left/right skate or toe/heel.
+//
+// With segmentCount at 0 the whole strip runs the current pattern as before.
+// Otherwise every segment renders its own pattern instance into its span of
+// segmentLeds, which persists between frames for patterns with trails, and
+// is copied into the output with the segment's brightness applied.
+//
+// Field values are bytes, so segment bounds are in units of SEGMENT_UNIT
+// LEDs: 1 for strips of up to 255 LEDs, more for longer ones.
+//
+// The segment table is stored in LittleFS and edited through the segment*
+// fields, which act on a copy of the selected segment (see fields.h).
+
+#define SEGMENT_UNIT (((SKATE_LED_LENGTH * 2) + 254) / 255)
+#define SEGMENT_UNITS (((SKATE_LED_LENGTH * 2) + SEGMENT_UNIT - 1) / SEGMENT_UNIT)
+#define SEGMENT_PATH "/segments.bin"
+#define SEGMENT_MAGIC 0x5E
+#define SEGMENT_VERSION 1
+
+typedef struct segment {
+  uint8_t start;  // in SEGMENT_UNIT leds
+  uint8_t length; // in SEGMENT_UNIT leds
+  uint8_t pattern;
+  uint8_t palette;
+  uint8_t speed;
+  uint8_t brightness;
+} Segment;
+
+typedef struct segment_file_header {
+  uint8_t magic;
+  uint8_t version;
+  uint8_t segmentSize; // sizeof(Segment) of the build that wrote the file
+  uint8_t count;       // segments that follow, up to SEGMENT_MAX
+  uint8_t segmentCount;
+} segment_file_header;
+
+uint8_t segmentCount = 0;
+Segment segments[SEGMENT_MAX] = {
+  // start, length, pattern, palette, speed, brightness: one per skate
+  { 0, SEGMENT_UNITS / 2, 0, 0, 20, 255 },
+  { SEGMENT_UNITS / 2, SEGMENT_UNITS - SEGMENT_UNITS / 2, 1, 0, 20, 255 },
+};
+
+// the segment the segment* fields currently edit, and their copy of it
+uint8_t selectedSegment = 0;
+Segment segmentEdit = segments[0];
+
+volatile bool segmentsDirty = false;
+
+CRGB segmentLeds[SKATE_LED_LENGTH * 2];
+
+// each segment's palette, expanded; only rebuilt when the segment's palette
+// changes. Only allocated while segments are on: SEGMENT_MAX * 818 bytes
+// that a strip running a single pattern shouldn't carry.
+PaletteLUT *segmentPaletteLUTs = NULL;
+
+// loop task only, like renderSegments()
+void releaseSegmentPaletteLUTs()
+{
+  if (!segmentPaletteLUTs)
+    return;
+  free(segmentPaletteLUTs);
+  segmentPaletteLUTs = NULL;
+}
+
+void renderSegments(RenderPixel *leds, uint16_t count)
+{
+  clearPixels(leds, count);
+
+  // zeroed like the static tables: black sources with nothing dirty, so the
+  // first setPaletteLUTSource() marks exactly the blocks to build
+  if (!segmentPaletteLUTs)
+    segmentPaletteLUTs = (PaletteLUT *)calloc(SEGMENT_MAX, sizeof(PaletteLUT));
+
+  for (uint8_t i = 0; i < segmentCount && i < SEGMENT_MAX; i++)
+  {
+    const Segment &segment = segments[i];
+    uint16_t start = segment.start * SEGMENT_UNIT;
+    if (start >= count)
+      continue;
+    uint16_t length = min((uint16_t)(segment.length * SEGMENT_UNIT), (uint16_t)(count - start));
+    if (length == 0)
+      continue;
+
+    PatternFrame frame = patternFrame(segmentLeds + start, length);
+    frame.speed = segment.speed;
+    // without memory for the tables, segments fall back to the global palette
+    if (segmentPaletteLUTs)
+    {
+      PaletteLUT &palette = segmentPaletteLUTs[i];
+      setPaletteLUTSource(palette, getPalette(segment.palette));
+      refreshPaletteLUT(palette);
+      frame.palette = &palette;
+      frame.blendedPalette = &palette;
+    }
+    renderPatternSlot(SEGMENT_PATTERN_SLOT(i), segment.pattern, frame);
+
+    for (uint16_t j = start; j < start + length; j++)
+    {
+      storeScaled(leds[j], segmentLeds[j], segment.brightness);
+    }
+  }
+}
+
+void sanitizeSegment(Segment &segment)
+{
+  segment.start = min(segment.start, (uint8_t)SEGMENT_UNITS);
+  segment.length = min(segment.length, (uint8_t)(SEGMENT_UNITS - segment.start));
+  segment.pattern = min(segment.pattern, (uint8_t)(patternCount - 1));
+  segment.palette = min(segment.palette, (uint8_t)(paletteCount - 1));
+}
+
+void loadSegments()
+{
+  File file = SPIFFS.open(SEGMENT_PATH, "r");
+  if (file)
+  {
+    segment_file_header header;
+    Segment stored[SEGMENT_MAX];
+    bool valid = file.read((uint8_t *)&header, sizeof(header)) == sizeof(header) &&
+                 header.magic == SEGMENT_MAGIC && header.version == SEGMENT_VERSION &&
+                 header.segmentSize == sizeof(Segment) && header.count <= SEGMENT_MAX &&
+                 file.read((uint8_t *)stored, header.count * sizeof(Segment)) == header.count * sizeof(Segment);
+    file.close();
+
+    if (valid)
+    {
+      for (uint8_t i = 0; i < header.count; i++)
+      {
+        segments[i] = stored[i];
+        sanitizeSegment(segments[i]);
+      }
+      segmentCount = min(header.segmentCount, (uint8_t)SEGMENT_MAX);
+    }
+    else
+    {
+      LOG_WARN("Ignoring stale or corrupt segment table");
+    }
+  }
+
+  segmentEdit = segments[selectedSegment];
+  segmentsDirty = false;
+}
+
+// LittleFS commits a file atomically on close, a torn write leaves the old table
+void saveSegments()
+{
+  File file = SPIFFS.open(SEGMENT_PATH, "w");
+  if (!file)
+    return;
+
+  segment_file_header header;
+  header.magic = SEGMENT_MAGIC;
+  header.version = SEGMENT_VERSION;
+  header.segmentSize = sizeof(Segment);
+  header.count = SEGMENT_MAX;
+  header.segmentCount = segmentCount;
+
+  file.write((const uint8_t *)&header, sizeof(header));
+  file.write((const uint8_t *)segments, sizeof(segments));
+  file.close();
+}
+
+// called by the settings task, so segment edits share its debounce
+void saveSegmentsIfDirty()
+{
+  if (!segmentsDirty)
+    return;
+  segmentsDirty = false;
+  saveSegments();
+}
@@ -0,0 +1,285 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Settings persistence.
+//
+// Field changes only mark the settings dirty. A low priority task on core 0
+// waits for SETTINGS_QUIET_MS without further changes and then writes one
+// record, so a slider drag costs a single commit at the end instead of one
+// flash erase per step inside the HTTP handler.
+//
+// Records rotate through SETTINGS_SLOTS fixed size slots and carry a version,
+// a hash of the field layout, a sequence number and a CRC. On boot the valid
+// record with the newest sequence wins, so a write torn by a brownout falls
+// back to the previous one. The payload is in the tagged form (field.h), so
+// a firmware update that adds or removes fields keeps every other value.
+// The ESP32 EEPROM library is backed by an NVS blob, which already wear
+// levels the underlying flash; more slots only make every commit bigger,
+// hence the default of two.
+
+#define SETTINGS_MAGIC 0xA5
+#define SETTINGS_VERSION 2
+#define SETTINGS_SLOTS 2
+#define SETTINGS_RECORD_SIZE 256
+#define SETTINGS_QUIET_MS 2000
+#define SETTINGS_TASK_PERIOD_MS 100
+
+typedef struct settings_record_header {
+  uint8_t magic;
+  uint8_t version;
+  uint16_t layout;   // fieldLayoutHash() of the build that wrote the record
+  uint16_t sequence;
+  uint16_t length;   // payload bytes following the header
+  uint16_t crc;      // over the header (crc = 0) and payload
+} settings_record_header;
+
+#define SETTINGS_PAYLOAD_SIZE (SETTINGS_RECORD_SIZE - sizeof(settings_record_header))
+
+volatile bool settingsDirty = false;
+volatile unsigned long settingsDirtyMillis = 0;
+uint16_t settingsSequence = 0;
+uint8_t settingsNextSlot = 0;
+
+void markSettingsDirty()
+{
+  settingsDirtyMillis = millis();
+  settingsDirty = true;
+}
+
+uint16_t crc16(const uint8_t *data, size_t length, uint16_t crc = 0xFFFF)
+{
+  // CRC-16/CCITT-FALSE
+  while (length--)
+  {
+    crc ^= (uint16_t)*data++ << 8;
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+  }
+  return crc;
+}
+
+// changes whenever a field is added, removed, renamed or changes size, so an
+// old record is never applied to the wrong fields
+uint16_t fieldLayoutHash(const FieldTable &table)
+{
+  uint32_t hash = 2166136261u;
+  for (uint8_t i = 0; i < table.count; i++)
+  {
+    hash = fieldNameHash(table.fields[i].name, hash);
+    hash ^= fieldBinarySize(table.fields[i]);
+    hash *= 16777619u;
+  }
+  return (hash >> 16) ^ (hash & 0xFFFF);
+}
+
+uint16_t settingsRecordCrc(settings_record_header header, const uint8_t *payload)
+{
+  header.crc = 0;
+  uint16_t crc = crc16((const uint8_t *)&header, sizeof(header));
+  return crc16(payload, header.length, crc);
+}
+
+// Reads the record at address. Values apply by field name, so a record of
+// any field layout is fine.
+bool readSettingsRecord(uint16_t address, settings_record_header &header, uint8_t *payload)
+{
+  EEPROM.readBytes(address, &header, sizeof(header));
+
+  if (header.magic != SETTINGS_MAGIC || header.version != SETTINGS_VERSION ||
+      header.length > SETTINGS_PAYLOAD_SIZE)
+    return false;
+
+  EEPROM.readBytes(address + sizeof(header), payload, header.length);
+  return settingsRecordCrc(header, payload) == header.crc;
+}
+
+// The slot holding the newest valid record, or -1
+int8_t findNewestSettingsRecord(uint16_t &sequence)
+{
+  uint8_t payload[SETTINGS_PAYLOAD_SIZE];
+  settings_record_header header;
+  int8_t newestSlot = -1;
+
+  for (uint8_t slot = 0; slot < SETTINGS_SLOTS; slot++)
+  {
+    if (!readSettingsRecord(slot * SETTINGS_RECORD_SIZE, header, payload))
+      continue;
+
+    // sequence numbers wrap, compare by distance
+    if (newestSlot < 0 || (int16_t)(header.sequence - sequence) > 0)
+    {
+      newestSlot = slot;
+      sequence = header.sequence;
+    }
+  }
+  return newestSlot;
+}
+
+void writeSettings(const FieldTable &table)
+{
+  uint8_t payload[SETTINGS_PAYLOAD_SIZE];
+
+  settings_record_header header;
+  header.magic = SETTINGS_MAGIC;
+  header.version = SETTINGS_VERSION;
+  header.layout = fieldLayoutHash(table);
+  header.sequence = ++settingsSequence;
+  header.length = writeFieldsTagged(table, payload, sizeof(payload));
+  header.crc = settingsRecordCrc(header, payload);
+
+  uint16_t address = settingsNextSlot * SETTINGS_RECORD_SIZE;
+  EEPROM.writeBytes(address + sizeof(header), payload, header.length);
+  EEPROM.writeBytes(address, &header, sizeof(header));
+  TRACE_SCOPE("eeprom commit");
+  EEPROM.commit();
+
+  settingsNextSlot = (settingsNextSlot + 1) % SETTINGS_SLOTS;
+}
+
+// Settings written before records existed: the raw values of these fields,
+// in this order, from address 0. The list is frozen, it describes what that
+// firmware wrote, so fields added since never pick up a stray byte.
+typedef struct legacy_settings_field {
+  const char *name;
+  uint8_t size;
+} legacy_settings_field;
+
+const legacy_settings_field legacySettingsFields[] = {
+  { "power",            1 },
+  { "brightness",       1 },
+  { "speed",            1 },
+  { "pattern",          1 },
+  { "autoplay",         1 },
+  { "autoplayDuration", 1 },
+  { "palette",          1 },
+  { "cyclePalettes",    1 },
+  { "paletteDuration",  1 },
+  { "solidColor",       3 },
+  { "cooling",          1 },
+  { "sparking",         1 },
+  { "twinkleSpeed",     1 },
+  { "twinkleDensity",   1 },
+  { "mirrored",         1 },
+  { "maxPower",         1 },
+};
+
+void loadLegacySettings(const FieldTable &table)
+{
+  uint16_t address = 0;
+  for (uint8_t i = 0; i < ARRAY_SIZE(legacySettingsFields); i++)
+  {
+    const legacy_settings_field &legacy = legacySettingsFields[i];
+    uint8_t bytes[3];
+    EEPROM.readBytes(address, bytes, legacy.size);
+    address += legacy.size;
+
+    const Field *field = getField(legacy.name, table);
+    if (field && fieldBinarySize(*field) == legacy.size)
+      readFieldBinary(*field, bytes);
+  }
+
+  // rewrite them as a record
+  markSettingsDirty();
+}
+
+void loadSettings(const FieldTable &table)
+{
+  static_assert(SETTINGS_SLOTS * SETTINGS_RECORD_SIZE <= 4096, "settings region too large for EEPROM");
+
+  if (!EEPROM.begin(SETTINGS_SLOTS * SETTINGS_RECORD_SIZE))
+  {
+    LOG_ERROR("Failed to initialize EEPROM!");
+    return;
+  }
+
+  uint16_t layout = fieldLayoutHash(table);
+  uint8_t payload[SETTINGS_PAYLOAD_SIZE];
+  settings_record_header header;
+  uint16_t sequence = 0;
+
+  int8_t slot = findNewestSettingsRecord(sequence);
+  if (slot >= 0)
+  {
+    readSettingsRecord(slot * SETTINGS_RECORD_SIZE, header, payload);
+    uint8_t applied = forEachTaggedField(table, payload, header.length, readFieldBinary);
+    if (header.layout == layout)
+    {
+      LOG_INFO("Loaded settings record %u from slot %d", sequence, slot);
+    }
+    else
+    {
+      LOG_INFO("Migrated %u values from settings record %u of an older field layout", applied, sequence);
+    }
+  }
+  else
+  {
+    uint8_t first = EEPROM.read(0);
+    if (first == 255)
+    {
+      LOG_INFO("First run, or EEPROM erased, skipping settings load!");
+    }
+    else if (first == SETTINGS_MAGIC)
+    {
+      // a record header, just not one this build can map to its fields
+      LOG_WARN("No usable settings record, keeping defaults");
+    }
+    else
+    {
+      LOG_WARN("No valid settings record, loading legacy settings");
+      loadLegacySettings(table);
+    }
+    return;
+  }
+
+  settingsSequence = sequence;
+  settingsNextSlot = (slot + 1) % SETTINGS_SLOTS;
+}
+
+TaskHandle_t settingsTaskHandle = NULL;
+
+void settingsTask(void *pvParameters)
+{
+  const FieldTable *table = (const FieldTable *)pvParameters;
+
+  for (;;)
+  {
+    vTaskDelay(pdMS_TO_TICKS(SETTINGS_TASK_PERIOD_MS));
+
+    if (!settingsDirty || millis() - settingsDirtyMillis < SETTINGS_QUIET_MS)
+      continue;
+
+    // clear first: a change that lands while we write marks dirty again
+    settingsDirty = false;
+    writeSettings(*table);
+    saveSegmentsIfDirty();
+  }
+}
+
+void setupSettings(const FieldTable &table)
+{
+  loadSettings(table);
+  xTaskCreatePinnedToCore(settingsTask, "settings", 4096, (void *)&table, tskIDLE_PRIORITY + 1, &settingsTaskHandle, 0);
+}
@@ -0,0 +1,140 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Frame timeline tracing. Build with -D ENABLE_TRACE and GET /trace returns
+// the last TRACE_EVENTS begin/end events as Chrome trace-event JSON, for
+// chrome://tracing or https://ui.perfetto.dev. One track per core.
+//
+// TRACE_SCOPE("name") records a begin event and, when the scope closes, an
+// end event. Names must be string literals, only the pointer is stored.
+// Without ENABLE_TRACE the macros compile to nothing. With it an event is an
+// atomic add, a micros() read and four stores, well under a microsecond.
+
+#ifdef ENABLE_TRACE
+
+#ifndef TRACE_EVENTS
+#define TRACE_EVENTS 1024 // must be a power of two
+#endif
+
+struct TraceEvent
+{
+  uint32_t micros;
+  const char *name;
+  char phase; // 'B' or 'E'
+  uint8_t core;
+};
+
+TraceEvent traceRing[TRACE_EVENTS];
+uint32_t traceHead = 0;     // events ever recorded, the next slot is traceHead % TRACE_EVENTS
+bool tracePaused = false;   // while /trace is being sent
+
+inline void traceEvent(const char *name, char phase)
+{
+  if (tracePaused)
+    return;
+
+  uint32_t i = __atomic_fetch_add(&traceHead, 1, __ATOMIC_RELAXED);
+  TraceEvent &event = traceRing[i & (TRACE_EVENTS - 1)];
+  event.micros = micros();
+  event.name = name;
+  event.phase = phase;
+  event.core = xPortGetCoreID();
+}
+
+struct TraceScope
+{
+  const char *name;
+  TraceScope(const char *name) : name(name) { traceEvent(name, 'B'); }
+  ~TraceScope() { traceEvent(name, 'E'); }
+};
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) TraceScope TRACE_CONCAT(traceScope, __LINE__)(name)
+
+// export cursor, one download at a time
+uint32_t traceExportNext = 0;
+uint32_t traceExportEnd = 0;
+bool traceExportFirst = true;
+
+// Fills `buffer` with as many whole events as fit, for a chunked response.
+size_t writeTraceChunk(uint8_t *buffer, size_t maxLen, size_t index)
+{
+  char *out = (char *)buffer;
+  size_t length = 0;
+
+  if (index == 0)
+  {
+    tracePaused = true;
+    traceExportEnd = traceHead;
+    traceExportNext = traceExportEnd > TRACE_EVENTS ? traceExportEnd - TRACE_EVENTS : 0;
+    traceExportFirst = true;
+    length += snprintf(out, maxLen, "{\"traceEvents\":[");
+  }
+
+  while (traceExportNext < traceExportEnd)
+  {
+    const TraceEvent &event = traceRing[traceExportNext & (TRACE_EVENTS - 1)];
+    char line[96];
+    size_t n = snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%u,\"pid\":1,\"tid\":%u}",
+                        traceExportFirst ? "" : ",",
+                        event.name, event.phase, event.micros, event.core);
+    if (length + n > maxLen)
+      return length;
+    memcpy(out + length, line, n);
+    length += n;
+    traceExportNext++;
+    traceExportFirst = false;
+  }
+
+  if (tracePaused)
+  {
+    if (length + 2 > maxLen)
+      return length;
+    memcpy(out + length, "]}", 2);
+    length += 2;
+    tracePaused = false;
+  }
+  return length;
+}
+
+void handleTraceRequest(AsyncWebServerRequest *request)
+{
+  request->onDisconnect([]() { tracePaused = false; });
+  request->send(request->beginChunkedResponse("application/json", writeTraceChunk));
+}
+
+#else
+
+#define TRACE_SCOPE(name) \
+  do                      \
+  {                       \
+  } while (0)
+
+void handleTraceRequest(AsyncWebServerRequest *request)
+{
+  request->send(404, "text/plain", "tracing is compiled out, build with -D ENABLE_TRACE");
+}
+
+#endif
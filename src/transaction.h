@@ -0,0 +1,233 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Staged field writes.
+//
+// Requests that change several fields at once (scene recall, batch updates)
+// stage the new values here instead of writing them straight away. The render
+// loop applies everything staged between two frames, so a frame never shows
+// half of a change, then marks the settings dirty and sends one WebSocket
+// message for the lot.
+//
+// Values are staged in the same binary form settings records use, at the
+// field's offset in that layout, with one pending bit per field. A scene
+// recall can stage a whole segment table too.
+
+#define FIELD_TRANSACTION_SIZE SETTINGS_PAYLOAD_SIZE
+#define FIELD_BATCH_MAX 32
+
+portMUX_TYPE fieldTransactionMux = portMUX_INITIALIZER_UNLOCKED;
+uint8_t stagedFieldBytes[FIELD_TRANSACTION_SIZE];
+uint8_t stagedFieldMask[(FIELD_INDEX_EMPTY + 7) / 8];
+Segment stagedSegments[SEGMENT_MAX];
+bool segmentsStaged = false;
+volatile bool fieldTransactionPending = false;
+bool fieldTransactionPersist = false;
+
+uint16_t fieldBinaryOffset(const FieldTable &table, uint8_t fieldIndex)
+{
+  uint16_t offset = 0;
+  for (uint8_t i = 0; i < fieldIndex; i++)
+  {
+    offset += fieldBinarySize(table.fields[i]);
+  }
+  return offset;
+}
+
+// stageField* must be called between beginFieldTransaction() and
+// commitFieldTransaction(); keep the work in between short, it holds a spinlock
+void beginFieldTransaction()
+{
+  portENTER_CRITICAL(&fieldTransactionMux);
+}
+
+void commitFieldTransaction(boolean persist = true)
+{
+  fieldTransactionPersist |= persist;
+  fieldTransactionPending = true;
+  portEXIT_CRITICAL(&fieldTransactionMux);
+}
+
+void stageFieldBinary(const FieldTable &table, const Field &field, const uint8_t *bytes)
+{
+  uint8_t fieldIndex = &field - table.fields;
+  uint8_t size = fieldBinarySize(field);
+  uint16_t offset = fieldBinaryOffset(table, fieldIndex);
+  if (size == 0 || offset + size > FIELD_TRANSACTION_SIZE)
+    return;
+
+  memcpy(stagedFieldBytes + offset, bytes, size);
+  stagedFieldMask[fieldIndex / 8] |= 1 << (fieldIndex % 8);
+}
+
+// stage a full segment table, applied before the staged fields
+void stageSegments(const Segment *table)
+{
+  memcpy(stagedSegments, table, sizeof(stagedSegments));
+  segmentsStaged = true;
+}
+
+// Stages a snapshot written by writeFieldsTagged(), except the device
+// fields, and segmentTable if given, as one transaction. Fields are matched
+// before the lock is taken. Returns the number of fields staged.
+uint8_t stageFieldsTagged(const FieldTable &table, const uint8_t *payload, uint16_t length, const Segment *segmentTable = NULL)
+{
+  const Field *updates[FIELD_INDEX_EMPTY];
+  const uint8_t *values[FIELD_INDEX_EMPTY];
+  uint8_t count = 0;
+  forEachTaggedField(table, payload, length, [&](const Field &field, const uint8_t *bytes) {
+    if (!isDeviceField(field))
+    {
+      updates[count] = &field;
+      values[count] = bytes;
+      count++;
+    }
+  });
+
+  beginFieldTransaction();
+  if (segmentTable)
+    stageSegments(segmentTable);
+  for (uint8_t i = 0; i < count; i++)
+  {
+    stageFieldBinary(table, *updates[i], values[i]);
+  }
+  commitFieldTransaction();
+
+  return count;
+}
+
+// Stages every name=value pair in body, separated by '&' or newlines, e.g.
+// "speed=30&palette=4&solidColor=255,0,64". The body is parsed in place and
+// doesn't need to be null terminated. Values are parsed before the lock is
+// taken so the spinlock only covers a memcpy per field. Returns the number of
+// fields staged, or -1 if any name was unknown, a device field (fields.h) or
+// any value unparseable, in which case nothing is staged.
+int stageFieldValues(const FieldTable &table, const char *body, size_t length)
+{
+  const Field *updates[FIELD_BATCH_MAX];
+  uint8_t values[FIELD_BATCH_MAX][3];
+  uint8_t count = 0;
+
+  const char *end = body + length;
+  const char *pair = body;
+  while (pair < end)
+  {
+    const char *pairEnd = pair;
+    while (pairEnd < end && *pairEnd != '&' && *pairEnd != '\n' && *pairEnd != '\r')
+      pairEnd++;
+
+    if (pairEnd > pair)
+    {
+      const char *equals = (const char *)memchr(pair, '=', pairEnd - pair);
+      if (!equals || count == FIELD_BATCH_MAX)
+        return -1;
+
+      const Field *field = getField(pair, equals - pair, table);
+      if (!field || isDeviceField(*field) || !parseFieldBinary(*field, equals + 1, pairEnd, values[count]))
+        return -1;
+
+      updates[count++] = field;
+    }
+
+    pair = pairEnd + 1;
+  }
+
+  if (count == 0)
+    return 0;
+
+  beginFieldTransaction();
+  for (uint8_t i = 0; i < count; i++)
+  {
+    stageFieldBinary(table, *updates[i], values[i]);
+  }
+  commitFieldTransaction();
+
+  return count;
+}
+
+// called from the render loop between frames
+void applyFieldTransaction(const FieldTable &table)
+{
+  if (!fieldTransactionPending)
+    return;
+
+  uint8_t bytes[FIELD_TRANSACTION_SIZE];
+  uint8_t mask[sizeof(stagedFieldMask)];
+  Segment segmentTable[SEGMENT_MAX];
+
+  portENTER_CRITICAL(&fieldTransactionMux);
+  memcpy(bytes, stagedFieldBytes, sizeof(bytes));
+  memcpy(mask, stagedFieldMask, sizeof(mask));
+  memset(stagedFieldMask, 0, sizeof(stagedFieldMask));
+  bool applySegments = segmentsStaged;
+  if (applySegments)
+    memcpy(segmentTable, stagedSegments, sizeof(segmentTable));
+  segmentsStaged = false;
+  bool persist = fieldTransactionPersist;
+  fieldTransactionPersist = false;
+  fieldTransactionPending = false;
+  portEXIT_CRITICAL(&fieldTransactionMux);
+
+  if (applySegments)
+  {
+    for (uint8_t i = 0; i < SEGMENT_MAX; i++)
+    {
+      segments[i] = segmentTable[i];
+      sanitizeSegment(segments[i]);
+    }
+    segmentEdit = segments[selectedSegment];
+    segmentsDirty = true;
+  }
+
+  // one message for every field that changed: [{"name":"..","value":..},...]
+  String json = "[";
+  uint16_t offset = 0;
+  for (uint8_t i = 0; i < table.count; i++)
+  {
+    const Field &field = table.fields[i];
+    uint8_t size = fieldBinarySize(field);
+    if (mask[i / 8] & (1 << (i % 8)))
+    {
+      readFieldBinary(field, bytes + offset);
+
+      if (json.length() > 1)
+        json += ",";
+      json += "{\"name\":\"";
+      json += field.name;
+      json += "\",\"value\":";
+      appendFieldValueJson(json, field);
+      json += "}";
+    }
+    offset += size;
+  }
+  json += "]";
+
+  webSocketsServer.broadcastTXT(json);
+  countWebSocketBroadcast();
+
+  if (persist)
+  {
+    markSettingsDirty();
+  }
+}
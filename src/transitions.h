@@ -0,0 +1,154 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Pattern transitions.
+//
+// When the current pattern changes, the new pattern starts in the other
+// pattern slot, seeded with the last frame of the old one, and both render
+// for transitionDuration tenths of a second. blendTransition() then mixes the
+// two buffers into the output in a single pass.
+
+enum TransitionType : uint8_t
+{
+  CutTransition,
+  CrossfadeTransition,
+  WipeTransition,
+  DissolveTransition,
+};
+
+const char *transitionNames[] = {
+  "Cut",
+  "Crossfade",
+  "Wipe",
+  "Dissolve",
+};
+
+const uint8_t transitionCount = ARRAY_SIZE(transitionNames);
+
+uint8_t transitionType = CrossfadeTransition;
+uint8_t transitionDuration = 10; // tenths of a second
+
+// frame buffers for pattern slots 0 and 1; patterns with trails read their
+// previous frame back from these
+CRGB transitionLeds[2][SKATE_LED_LENGTH * 2];
+
+uint8_t activePatternSlot = 0;
+int8_t outgoingPatternSlot = -1; // -1 when no transition is running
+unsigned long transitionStartMillis = 0;
+uint16_t transitionMillis = 0;
+
+// Wipe edge width in pixels, softens the boundary so it doesn't step
+#define WIPE_EDGE 8
+
+// out = from * (1 - amount) + to * amount, with `amount` per pixel depending
+// on the type. One loop per type keeps the per pixel work to the blend itself.
+void blendTransition(const CRGB *from, const CRGB *to, RenderPixel *out, uint16_t count, uint8_t type, uint8_t progress)
+{
+  switch (type)
+  {
+  case WipeTransition:
+  {
+    // a soft edge sweeps from the first pixel to the last
+    int32_t edge = ((int32_t)(count + WIPE_EDGE) * progress) >> 8;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      int32_t distance = edge - i;
+      uint8_t amount = distance >= WIPE_EDGE ? 255 : distance <= 0 ? 0 : (distance * 255) / WIPE_EDGE;
+      storeBlend(out[i], from[i], to[i], amount);
+    }
+    break;
+  }
+
+  case DissolveTransition:
+  {
+    // every pixel flips once its fixed pseudo random threshold is passed
+    uint16_t threshold = 11337;
+    for (uint16_t i = 0; i < count; i++)
+    {
+      threshold = (uint16_t)(threshold * 2053) + 1384;
+      storePixel(out[i], (threshold >> 8) < progress ? to[i] : from[i]);
+    }
+    break;
+  }
+
+  default:
+    for (uint16_t i = 0; i < count; i++)
+    {
+      storeBlend(out[i], from[i], to[i], progress);
+    }
+    break;
+  }
+}
+
+void startTransition(uint8_t patternIndex, uint16_t count)
+{
+  uint8_t incoming = activePatternSlot ^ 1;
+
+  startPattern(incoming, patternIndex);
+  memcpy(transitionLeds[incoming], transitionLeds[activePatternSlot], count * sizeof(CRGB));
+
+  transitionMillis = transitionType == CutTransition ? 0 : transitionDuration * 100;
+  outgoingPatternSlot = transitionMillis ? activePatternSlot : -1;
+  transitionStartMillis = millis();
+  activePatternSlot = incoming;
+}
+
+// Renders the current pattern, and during a transition the outgoing one as
+// well, into `leds`.
+void renderPatterns(RenderPixel *leds, uint16_t count)
+{
+  PatternSlot &active = patternSlots[activePatternSlot];
+  if (!active.pattern)
+  {
+    startPattern(activePatternSlot, currentPatternIndex);
+  }
+  else if (active.patternIndex != currentPatternIndex)
+  {
+    // changing again mid transition drops the old outgoing pattern
+    startTransition(currentPatternIndex, count);
+  }
+
+  CRGB *to = transitionLeds[activePatternSlot];
+  PatternFrame frame = patternFrame(to, count);
+  renderPatternSlot(activePatternSlot, currentPatternIndex, frame);
+
+  if (outgoingPatternSlot >= 0)
+  {
+    unsigned long elapsed = millis() - transitionStartMillis;
+    if (elapsed < transitionMillis)
+    {
+      CRGB *from = transitionLeds[outgoingPatternSlot];
+      PatternFrame outgoingFrame = patternFrame(from, count);
+      renderPatternSlot(outgoingPatternSlot, patternSlots[outgoingPatternSlot].patternIndex, outgoingFrame);
+      blendTransition(from, to, leds, count, transitionType, (elapsed * 256) / transitionMillis);
+      return;
+    }
+    outgoingPatternSlot = -1;
+  }
+
+  for (uint16_t i = 0; i < count; i++)
+  {
+    storePixel(leds[i], to[i]);
+  }
+}
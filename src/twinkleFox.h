@@ -119,6 +119,53 @@ void coolLikeIncandescent( CRGB& c, uint8_t phase)
   c.b = qsub8( c.b, cooling * 2);
 }
 
+// TwinkleFOX regenerates each pixel's clock parameters from the PRNG every
+// frame to save RAM. The ESP32 has RAM to spare and not much time per frame,
+// so they're drawn once into this table instead. Pixel i gets the same
+// parameters in every Twinkles instance, so one table serves them all.
+// The slow cycle (a pixel's hue and whether it lights this cycle) only moves
+// every 256 ticks, so it's kept too, along with the tick it was computed for.
+// The table covers the longest frame the strip can give, 8 bytes a pixel.
+#define TWINKLE_EPOCH_STALE 0x100
+#ifndef TWINKLE_PIXELS
+#define TWINKLE_PIXELS (SKATE_LED_LENGTH * 2)
+#endif
+static_assert(TWINKLE_PIXELS >= SKATE_LED_LENGTH * 2, "twinkle table shorter than the strip");
+
+struct TwinklePixel
+{
+  uint16_t clockOffset;
+  uint8_t speedMultiplierQ5_3;
+  uint8_t salt;
+  uint16_t slowEpoch; // ticks >> 8 slowcycle8 belongs to, or TWINKLE_EPOCH_STALE
+  uint8_t slowcycle8;
+};
+
+TwinklePixel twinklePixels[TWINKLE_PIXELS];
+bool twinklePixelsSeeded = false;
+uint8_t twinklePixelsSpeed = 0; // twinkleSpeed the cached epochs were measured with
+
+void seedTwinklePixels()
+{
+  // "PRNG16" is the pseudorandom number generator
+  // It MUST be reset to the same starting value each time,
+  // so that the sequence of 'random' numbers that it generates
+  // is (paradoxically) stable.
+  uint16_t PRNG16 = 11337;
+
+  for (uint16_t i = 0; i < ARRAY_SIZE(twinklePixels); i++) {
+    TwinklePixel &p = twinklePixels[i];
+    PRNG16 = (uint16_t)(PRNG16 * 2053) + 1384; // next 'random' number
+    p.clockOffset = PRNG16; // use that number as clock offset
+    PRNG16 = (uint16_t)(PRNG16 * 2053) + 1384; // next 'random' number
+    // use that number as clock speed adjustment factor (in 8ths, from 8/8ths to 23/8ths)
+    p.speedMultiplierQ5_3 = ((((PRNG16 & 0xFF)>>4) + (PRNG16 & 0x0F)) & 0x0F) + 0x08;
+    p.salt = PRNG16 >> 8; // get 'salt' value for this pixel
+    p.slowEpoch = TWINKLE_EPOCH_STALE;
+  }
+  twinklePixelsSeeded = true;
+}
+
 //  This function takes a time in pseudo-milliseconds,
 //  figures out brightness = f( time ), and also hue = f( time )
 //  The 'low digits' of the millisecond time are used as
@@ -128,29 +175,33 @@ void coolLikeIncandescent( CRGB& c, uint8_t phase)
 //  of one cycle of the brightness wave function.
 //  The 'high digits' are also used to determine whether this pixel
 //  should light at all during this cycle, based on the twinkleDensity.
-CRGB computeOneTwinkle( uint32_t ms, uint8_t salt)
+CRGB computeOneTwinkle( const PaletteLUT& palette, uint32_t ms, TwinklePixel& pixel)
 {
   uint16_t ticks = ms >> (8-twinkleSpeed);
   uint8_t fastcycle8 = ticks;
-  uint16_t slowcycle16 = (ticks >> 8) + salt;
-  slowcycle16 += sin8( slowcycle16);
-  slowcycle16 =  (slowcycle16 * 2053) + 1384;
-  uint8_t slowcycle8 = (slowcycle16 & 0xFF) + (slowcycle16 >> 8);
-
-  uint8_t bright = 0;
-  if( ((slowcycle8 & 0x0E)/2) < twinkleDensity) {
-    bright = attackDecayWave8( fastcycle8);
+  uint8_t epoch = ticks >> 8;
+  if( pixel.slowEpoch != epoch) {
+    uint16_t slowcycle16 = epoch + pixel.salt;
+    slowcycle16 += sin8( slowcycle16);
+    slowcycle16 =  (slowcycle16 * 2053) + 1384;
+    pixel.slowcycle8 = (slowcycle16 & 0xFF) + (slowcycle16 >> 8);
+    pixel.slowEpoch = epoch;
   }
+  uint8_t slowcycle8 = pixel.slowcycle8;
 
-  uint8_t hue = slowcycle8 - salt;
-  CRGB c;
-  if( bright > 0) {
-    c = ColorFromPalette( palettes[currentPaletteIndex], hue, bright, NOBLEND);
-    if( COOL_LIKE_INCANDESCENT == 1 ) {
-      coolLikeIncandescent( c, fastcycle8);
-    }
-  } else {
-    c = CRGB::Black;
+  if( ((slowcycle8 & 0x0E)/2) >= twinkleDensity) {
+    return CRGB::Black;
+  }
+
+  uint8_t bright = attackDecayWave8( fastcycle8);
+  if( bright == 0) {
+    return CRGB::Black;
+  }
+
+  uint8_t hue = slowcycle8 - pixel.salt;
+  CRGB c = paletteColorNoBlend( palette, hue, bright);
+  if( COOL_LIKE_INCANDESCENT == 1 ) {
+    coolLikeIncandescent( c, fastcycle8);
   }
   return c;
 }
@@ -159,27 +210,30 @@ CRGB computeOneTwinkle( uint32_t ms, uint8_t salt)
 //  adjusted 'clock' that this pixel should use, and calls
 //  "CalculateOneTwinkle" on each pixel.  It then displays
 //  either the twinkle color of the background color,
-//  whichever is brighter.
-void drawTwinkles(CRGB *leds, uint16_t count)
+//  whichever is brighter. With a stride > 1 only every stride-th pixel,
+//  starting at phase, is updated. clock32 is the time in milliseconds.
+void drawTwinklesAt(CRGB *leds, uint16_t count, const PaletteLUT& palette, uint32_t clock32, uint8_t stride = 1, uint8_t phase = 0)
 {
-  // "PRNG16" is the pseudorandom number generator
-  // It MUST be reset to the same starting value each time
-  // this function is called, so that the sequence of 'random'
-  // numbers that it generates is (paradoxically) stable.
-  uint16_t PRNG16 = 11337;
-
-  uint32_t clock32 = millis();
+  if( !twinklePixelsSeeded) {
+    seedTwinklePixels();
+  }
+  if( twinklePixelsSpeed != twinkleSpeed) {
+    // ticks mean something else now, so the cached epochs can't be trusted
+    for(uint16_t i = 0; i < ARRAY_SIZE(twinklePixels); i++) {
+      twinklePixels[i].slowEpoch = TWINKLE_EPOCH_STALE;
+    }
+    twinklePixelsSpeed = twinkleSpeed;
+  }
+  count = min(count, (uint16_t)ARRAY_SIZE(twinklePixels));
 
-  CRGBPalette16 currentPalette = palettes[currentPaletteIndex];
-  
   // Set up the background color, "bg".
   // if AUTO_SELECT_BACKGROUND_COLOR == 1, and the first two colors of
   // the current palette are identical, then a deeply faded version of
   // that color is used for the background color
   CRGB bg;
   if( (AUTO_SELECT_BACKGROUND_COLOR == 1) &&
-      (currentPalette[0] == currentPalette[1] )) {
-    bg = currentPalette[0];
+      (palette.source[0] == palette.source[1] )) {
+    bg = palette.source[0];
     uint8_t bglight = bg.getAverageLight();
     if( bglight > 64) {
       bg.nscale8_video( 16); // very bright, so scale to 1/16th
@@ -194,21 +248,16 @@ void drawTwinkles(CRGB *leds, uint16_t count)
 
   uint8_t backgroundBrightness = bg.getAverageLight();
 
-  for(uint16_t i = 0; i < count; i++) {
+  for(uint16_t i = phase; i < count; i += stride) {
     CRGB& pixel = leds[i];
 
-    PRNG16 = (uint16_t)(PRNG16 * 2053) + 1384; // next 'random' number
-    uint16_t myclockoffset16= PRNG16; // use that number as clock offset
-    PRNG16 = (uint16_t)(PRNG16 * 2053) + 1384; // next 'random' number
-    // use that number as clock speed adjustment factor (in 8ths, from 8/8ths to 23/8ths)
-    uint8_t myspeedmultiplierQ5_3 =  ((((PRNG16 & 0xFF)>>4) + (PRNG16 & 0x0F)) & 0x0F) + 0x08;
-    uint32_t myclock30 = (uint32_t)((clock32 * myspeedmultiplierQ5_3) >> 3) + myclockoffset16;
-    uint8_t  myunique8 = PRNG16 >> 8; // get 'salt' value for this pixel
+    TwinklePixel& twinkle = twinklePixels[i];
+    uint32_t myclock30 = (uint32_t)((clock32 * twinkle.speedMultiplierQ5_3) >> 3) + twinkle.clockOffset;
 
     // We now have the adjusted 'clock' for this pixel, now we call
     // the function that computes what color the pixel should be based
     // on the "brightness = f( time )" idea.
-    CRGB c = computeOneTwinkle( myclock30, myunique8);
+    CRGB c = computeOneTwinkle( palette, myclock30, twinkle);
 
     uint8_t cbright = c.getAverageLight();
     int16_t deltabright = cbright - backgroundBrightness;
@@ -227,3 +276,19 @@ void drawTwinkles(CRGB *leds, uint16_t count)
     }
   }
 }
+
+void drawTwinkles(CRGB *leds, uint16_t count, const PaletteLUT& palette, uint8_t stride = 1, uint8_t phase = 0)
+{
+  drawTwinklesAt(leds, count, palette, GET_MILLIS(), stride, phase);
+}
+
+// per-pixel state lives in twinklePixels, shared by every instance
+class Twinkles : public Pattern
+{
+public:
+  void render(const PatternFrame &frame) override
+  {
+    drawTwinkles(frame.leds, frame.count, *frame.palette, frame.stride, frame.phase);
+  }
+  bool partialRender() const override { return true; }
+};
@@ -0,0 +1,187 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Warm state: the live render state mirrored into RTC slow memory, which
+// keeps its contents through a brownout, watchdog or software reset. After
+// such a reset the animation resumes from the mirror instead of restarting
+// from the EEPROM settings with fresh pattern instances. A panic always
+// starts cold, and so does a reset that comes within WARM_STATE_STABLE of a
+// warm start, so a state that crashes the firmware can't loop.
+//
+// Pattern instances are copied as raw bytes, vtable pointer included, so a
+// mirror is only trusted by the build that wrote it.
+
+// Pattern timing (beatsin, EVERY_N_MILLIS, twinkles) reads FastLED's
+// GET_MILLIS, which main.cpp points here. The offset carries the timebase
+// across a warm reset.
+uint32_t timebaseOffset = 0;
+
+#ifdef PIO_UNIT_TESTING
+// the tests in test/ stop the clock to render two versions at one instant
+bool timebaseFrozen = false;
+uint32_t frozenMillis = 0;
+#endif
+
+uint32_t get_millisecond_timer()
+{
+#ifdef PIO_UNIT_TESTING
+  if (timebaseFrozen)
+    return frozenMillis;
+#endif
+  return millis() + timebaseOffset;
+}
+
+#define WARM_STATE_MAGIC 0x57524D31 // "WRM1"
+#define WARM_STATE_INTERVAL 25      // ms between mirrors
+#define WARM_STATE_NO_PATTERN 0xFF
+#define WARM_STATE_STABLE 10000     // ms of uptime before a warm start counts as good
+
+typedef struct
+{
+  uint32_t magic;
+  uint32_t build;                       // warmStateBuild() of the writer
+  uint32_t timebase;                    // get_millisecond_timer() when written
+  uint8_t patternIndex;
+  uint8_t paletteIndex;
+  uint8_t hue;
+  uint8_t activeSlot;
+  uint8_t warmStart;                    // written during an unproven warm start
+  uint16_t randomSeed;
+  CRGBPalette16 palette;                // currentPalette, part way through a blend
+  uint8_t slotPatterns[PATTERN_SLOTS];  // WARM_STATE_NO_PATTERN for an empty slot
+  alignas(8) uint8_t slots[PATTERN_SLOTS][PATTERN_STATE_SIZE];
+  CRGB frame[SKATE_LED_LENGTH * 2];     // last render of the active slot(s), for trails
+  uint32_t checksum;                    // over everything above
+} WarmState;
+
+// RTC slow memory is 8KB, shared with the rest of the system
+static_assert(sizeof(WarmState) <= 6144, "warm state too big for RTC memory, lower SEGMENT_MAX or SKATE_LED_LENGTH");
+
+RTC_NOINIT_ATTR WarmState warmState;
+bool warmStartPending = false;
+
+uint32_t fnv1a(const uint8_t *data, size_t length, uint32_t hash = 2166136261u)
+{
+  while (length--)
+  {
+    hash ^= *data++;
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+uint32_t warmStateBuild()
+{
+  static const char build[] = __DATE__ " " __TIME__;
+  return fnv1a((const uint8_t *)build, sizeof(build), sizeof(WarmState));
+}
+
+uint32_t warmStateChecksum()
+{
+  return fnv1a((const uint8_t *)&warmState, offsetof(WarmState, checksum));
+}
+
+// The buffer the current pattern(s) render into and read their trails from
+CRGB *warmStateFrame()
+{
+  return segmentCount > 0 ? segmentLeds : transitionLeds[activePatternSlot];
+}
+
+// Called from the loop every WARM_STATE_INTERVAL. A reset part way through
+// leaves a checksum mismatch, so the next boot starts cold.
+void saveWarmState()
+{
+  TRACE_SCOPE("warm state");
+  warmState.magic = WARM_STATE_MAGIC;
+  warmState.build = warmStateBuild();
+  warmState.timebase = get_millisecond_timer();
+  warmState.patternIndex = currentPatternIndex;
+  warmState.paletteIndex = currentPaletteIndex;
+  warmState.hue = gHue;
+  warmState.activeSlot = activePatternSlot;
+  if (warmStartPending && millis() >= WARM_STATE_STABLE)
+    warmStartPending = false;
+  warmState.warmStart = warmStartPending;
+  warmState.randomSeed = random16_get_seed();
+  warmState.palette = currentPalette;
+  for (uint8_t i = 0; i < PATTERN_SLOTS; i++)
+  {
+    const PatternSlot &s = patternSlots[i];
+    warmState.slotPatterns[i] = s.pattern ? s.patternIndex : WARM_STATE_NO_PATTERN;
+    if (s.pattern)
+    {
+      memcpy(warmState.slots[i], s.memory, PATTERN_STATE_SIZE);
+    }
+  }
+  memcpy(warmState.frame, warmStateFrame(), sizeof(warmState.frame));
+  warmState.checksum = warmStateChecksum();
+}
+
+// Call in setup() after the settings and segments are loaded and before
+// setupPalettes(). Returns false on a cold boot.
+bool restoreWarmState()
+{
+  esp_reset_reason_t reason = esp_reset_reason();
+  bool warmReason = reason == ESP_RST_BROWNOUT || reason == ESP_RST_SW || reason == ESP_RST_WDT ||
+                    reason == ESP_RST_TASK_WDT || reason == ESP_RST_INT_WDT;
+  if (!warmReason || warmState.magic != WARM_STATE_MAGIC ||
+      warmState.build != warmStateBuild() || warmState.checksum != warmStateChecksum() ||
+      warmState.patternIndex >= patternCount || warmState.paletteIndex >= paletteCount ||
+      warmState.activeSlot > 1)
+  {
+    warmState.magic = 0;
+    return false;
+  }
+  if (warmState.warmStart)
+  {
+    LOG_WARN("Reset %d soon after a warm start, starting cold", reason);
+    warmState.magic = 0;
+    return false;
+  }
+
+  currentPatternIndex = warmState.patternIndex;
+  currentPaletteIndex = warmState.paletteIndex;
+  gHue = warmState.hue;
+  currentPalette = warmState.palette;
+  random16_set_seed(warmState.randomSeed);
+
+  activePatternSlot = warmState.activeSlot;
+  outgoingPatternSlot = -1;
+  for (uint8_t i = 0; i < PATTERN_SLOTS; i++)
+  {
+    uint8_t patternIndex = warmState.slotPatterns[i];
+    if (patternIndex < patternCount)
+    {
+      // construct first so the slot is set up, then take the saved state
+      startPattern(i, patternIndex);
+      memcpy(patternSlots[i].memory, warmState.slots[i], PATTERN_STATE_SIZE);
+    }
+  }
+  memcpy(warmStateFrame(), warmState.frame, sizeof(warmState.frame));
+
+  timebaseOffset = warmState.timebase - millis();
+  warmStartPending = true;
+  LOG_INFO("Warm start after reset reason %d, resuming %s", reason, patterns[currentPatternIndex].name);
+  return true;
+}
@@ -22,20 +22,19 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
 */
 
-uint8_t connectTry = 0;
 
 void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
 {
   switch (type)
   {
   case WStype_DISCONNECTED:
-    Serial.printf("[%u] Disconnected!\n", num);
+    LOG_INFO("[%u] Disconnected!", num);
     break;
 
   case WStype_CONNECTED:
   {
     IPAddress ip = webSocketsServer.remoteIP(num);
-    Serial.printf("[%u] Connected from %d.%d.%d.%d url: %s\n", num, ip[0], ip[1], ip[2], ip[3], payload);
+    LOG_INFO("[%u] Connected from %d.%d.%d.%d url: %s", num, ip[0], ip[1], ip[2], ip[3], (const char *)payload);
 
     // send message to client
     // webSocketsServer.sendTXT(num, "Connected");
@@ -43,7 +42,7 @@ void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
   break;
 
   case WStype_TEXT:
-    Serial.printf("[%u] get Text: %s\n", num, payload);
+    LOG_DEBUG("[%u] get Text: %s", num, (const char *)payload);
 
     // send message to client
     // webSocketsServer.sendTXT(num, "message here");
@@ -53,7 +52,7 @@ void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
     break;
 
   case WStype_BIN:
-    Serial.printf("[%u] get binary length: %u\n", num, length);
+    LOG_DEBUG("[%u] get binary length: %u", num, (unsigned)length);
     //  hexdump(payload, length);
 
     // send message to client
@@ -62,93 +61,243 @@ void webSocketEvent(uint8_t num, WStype_t type, uint8_t *payload, size_t length)
   }
 }
 
+// Batch update state, hung off request->_tempObject (the server free()s it).
+// A body that arrives in one chunk is parsed straight out of the receive
+// buffer; only bodies split over several chunks are gathered into `data`.
+// FIELD_BATCH_MAX pairs fit well within FIELD_BATCH_BODY_MAX, anything longer
+// is refused before a byte of it is buffered. When the buffer can't be had,
+// a bare header still records that so the client doesn't get a 200.
+#define FIELD_BATCH_BODY_MAX 768
+#define FIELD_BATCH_TOO_LARGE -2
+#define FIELD_BATCH_NO_MEMORY -3
+
+typedef struct field_batch_body {
+  int staged;
+  size_t received;
+  char data[];
+} field_batch_body;
+
+void handleFieldValuesBody(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)
+{
+  if (index == 0)
+  {
+    bool tooLarge = total > FIELD_BATCH_BODY_MAX;
+    bool whole = len == total;
+    field_batch_body *body = (field_batch_body *)malloc(sizeof(field_batch_body) + (tooLarge || whole ? 0 : total));
+    if (tooLarge || !body)
+    {
+      if (!body)
+        body = (field_batch_body *)malloc(sizeof(field_batch_body));
+      if (body)
+        body->staged = tooLarge ? FIELD_BATCH_TOO_LARGE : FIELD_BATCH_NO_MEMORY;
+      request->_tempObject = body;
+      return;
+    }
+    body->staged = whole ? stageFieldValues(fieldTable, (const char *)data, len) : 0;
+    body->received = 0;
+    request->_tempObject = body;
+    if (whole)
+      return;
+  }
+
+  field_batch_body *body = (field_batch_body *)request->_tempObject;
+  if (!body || body->staged < 0 || index + len > total)
+    return;
+
+  memcpy(body->data + index, data, len);
+  body->received += len;
+  if (body->received == total)
+    body->staged = stageFieldValues(fieldTable, body->data, total);
+}
+
 void setupWeb()
 {
   webServer.on("/all", HTTP_GET, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web GET /all");
     digitalWrite(LED_BUILTIN, HIGH);
-    String json = getFieldsJson(fields, fieldCount);
+    String json = getFieldsJson(fieldTable);
     request->send(200, "text/json", json);
     digitalWrite(LED_BUILTIN, LOW);
   });
 
   webServer.on("/fieldValue", HTTP_GET, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web GET /fieldValue");
+    AsyncWebParameter *nameParam = request->getParam("name");
+    if (!nameParam)
+    {
+      request->send(400, "text/plain", "missing name");
+      return;
+    }
     digitalWrite(LED_BUILTIN, HIGH);
-    String name = request->getParam("name")->value();
-    String value = getFieldValue(name, fields, fieldCount);
+    const String &name = nameParam->value();
+    const Field *field = getField(name.c_str(), fieldTable);
+    char value[FIELD_VALUE_MAX_LENGTH] = "";
+    if (field)
+    {
+      formatFieldValue(*field, value, sizeof(value));
+    }
     request->send(200, "text/json", value);
     digitalWrite(LED_BUILTIN, LOW);
   });
 
   webServer.on("/fieldValue", HTTP_POST, [](AsyncWebServerRequest *request) {
-    digitalWrite(LED_BUILTIN, HIGH);
-    String name = request->getParam("name", true)->value();
+    TRACE_SCOPE("web POST /fieldValue");
+    AsyncWebParameter *nameParam = request->getParam("name", true);
+    if (!nameParam)
+    {
+      request->send(400, "text/plain", "missing name");
+      return;
+    }
 
-    Field field = getField(name, fields, fieldCount);
+    const Field *field = getField(nameParam->value().c_str(), fieldTable);
+    if (!field)
+    {
+      request->send(404, "text/plain", "unknown field");
+      return;
+    }
+
+    // colors come as r, g and b, everything else as value
     String value;
-    if (field.type == ColorFieldType)
+    if (field->type == ColorFieldType)
     {
-      String r = request->getParam("r", true)->value();
-      String g = request->getParam("g", true)->value();
-      String b = request->getParam("b", true)->value();
-      value = r + "," + g + "," + b;
+      AsyncWebParameter *r = request->getParam("r", true);
+      AsyncWebParameter *g = request->getParam("g", true);
+      AsyncWebParameter *b = request->getParam("b", true);
+      if (r && g && b)
+        value = r->value() + "," + g->value() + "," + b->value();
     }
     else
     {
-      value = request->getParam("value", true)->value();
+      AsyncWebParameter *valueParam = request->getParam("value", true);
+      if (valueParam)
+        value = valueParam->value();
     }
 
-    String newValue = setFieldValue(name, value, fields, fieldCount);
+    digitalWrite(LED_BUILTIN, HIGH);
+    if (!setFieldValue(*field, value.c_str()))
+    {
+      request->send(400, "text/plain", "missing or bad value");
+      digitalWrite(LED_BUILTIN, LOW);
+      return;
+    }
+
+    String newValue;
+    appendFieldValueJson(newValue, *field);
     request->send(200, "text/json", newValue);
     digitalWrite(LED_BUILTIN, LOW);
   });
 
+  // Batch update: "name=value" pairs separated by '&' or newlines, e.g.
+  // curl -H 'Content-Type: text/x-field-values' --data-binary 'speed=30&palette=4' http://192.168.4.1/fieldValues
+  // Everything is applied between two frames, persisted and broadcast once.
+  // The server splits form-urlencoded (and param-like text/plain) bodies into
+  // params itself, so only other content types reach the in-place parser.
+  webServer.on("/fieldValues", HTTP_POST, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web POST /fieldValues");
+    int staged = 0;
+    field_batch_body *body = (field_batch_body *)request->_tempObject;
+    if (body)
+    {
+      staged = body->staged;
+    }
+    else
+    {
+      String pairs;
+      for (size_t i = 0; i < request->params(); i++)
+      {
+        AsyncWebParameter *param = request->getParam(i);
+        if (param->isPost())
+          pairs += param->name() + "=" + param->value() + "&";
+      }
+      staged = stageFieldValues(fieldTable, pairs.c_str(), pairs.length());
+    }
+
+    if (staged == FIELD_BATCH_TOO_LARGE)
+    {
+      request->send(413, "text/plain", "body too large");
+      return;
+    }
+    if (staged == FIELD_BATCH_NO_MEMORY)
+    {
+      request->send(503, "text/plain", "out of memory");
+      return;
+    }
+    if (staged < 0)
+    {
+      request->send(400, "text/plain", "unknown field or bad value");
+      return;
+    }
+    request->send(200, "text/json", "{\"staged\":" + String(staged) + "}");
+  }, NULL, handleFieldValuesBody);
+
+  webServer.on("/scenes/save", HTTP_POST, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web POST /scenes/save");
+    AsyncWebParameter *nameParam = request->getParam("name", true);
+    if (!nameParam)
+    {
+      request->send(400, "text/plain", "missing name");
+      return;
+    }
+    const String &name = nameParam->value();
+    bool saved = saveScene(name.c_str(), fieldTable);
+    request->send(saved ? 200 : 400, "text/json", getScenesJson());
+  });
+
+  webServer.on("/scenes/recall", HTTP_POST, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web POST /scenes/recall");
+    AsyncWebParameter *nameParam = request->getParam("name", true);
+    if (!nameParam)
+    {
+      request->send(400, "text/plain", "missing name");
+      return;
+    }
+    const String &name = nameParam->value();
+    bool recalled = recallScene(name.c_str(), fieldTable);
+    request->send(recalled ? 200 : 404, "text/plain", recalled ? "ok" : "unknown scene");
+  });
+
+  webServer.on("/scenes/delete", HTTP_POST, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web POST /scenes/delete");
+    AsyncWebParameter *nameParam = request->getParam("name", true);
+    if (!nameParam)
+    {
+      request->send(400, "text/plain", "missing name");
+      return;
+    }
+    const String &name = nameParam->value();
+    bool deleted = deleteScene(name.c_str());
+    request->send(deleted ? 200 : 404, "text/json", getScenesJson());
+  });
+
+  webServer.on("/scenes", HTTP_GET, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web GET /scenes");
+    request->send(200, "text/json", getScenesJson());
+  });
+
+  webServer.on("/metrics", HTTP_GET, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web GET /metrics");
+    request->send(200, "text/plain; version=0.0.4", getMetricsText());
+  });
+
+  webServer.on("/trace", HTTP_GET, handleTraceRequest);
+
+  webServer.on("/power", HTTP_GET, [](AsyncWebServerRequest *request) {
+    TRACE_SCOPE("web GET /power");
+    request->send(200, "text/json", getPowerJson());
+  });
+
   webServer.serveStatic("/", SPIFFS, "/").setDefaultFile("index.htm").setCacheControl("max-age=864000");
 
   webServer.begin();
-  Serial.println("HTTP server started");
+  LOG_INFO("HTTP server started");
 
   webSocketsServer.begin();
   webSocketsServer.onEvent(webSocketEvent);
-  Serial.println("WebSockets server started");
+  LOG_INFO("WebSockets server started");
 }
 
 void handleWeb()
 {
-  static bool webServerStarted = false;
-
-  // check for connection
-  if (apMode == true || (apMode == false && WiFi.status() == WL_CONNECTED))
-  {
-    if (!webServerStarted)
-    {
-      // turn off the board's LED when connected to wifi
-      digitalWrite(LED_BUILTIN, HIGH);
-      Serial.println();
-      Serial.println("WiFi connected");
-      Serial.print("IP address: ");
-      Serial.println(WiFi.localIP());
-      webServerStarted = true;
-      digitalWrite(LED_BUILTIN, LOW);
-    }
-
-    webSocketsServer.loop();
-  }
-  else
-  {
-    // blink the board's LED while connecting to wifi
-    // static uint8_t ledState = 0;
-    EVERY_N_MILLIS(125)
-    {
-      // ledState = ;
-      digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
-      connectTry = connectTry + 1;
-      if (connectTry > 30)
-      {
-        Serial.println("");
-        Serial.println("could not connect to wifi, restarting...");
-        ESP.restart();
-      }
-      Serial.print(".");
-    }
-  }
+  // the servers listen on whichever interface is up, see handleWifi()
+  webSocketsServer.loop();
 }
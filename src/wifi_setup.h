@@ -24,11 +24,106 @@
 
 #pragma once
 
-const bool apMode = true;
+// 0 runs the skate's own access point, 1 joins the network in secrets.h.
+// Changed at runtime with the stationMode field.
+uint8_t stationMode = 0;
 
+// Station mode is a state machine fed by WiFi events and stepped by
+// handleWifi() on the network task (main.cpp), never on the render loop:
+// WiFi.mode() and softAP() can block for a while. A failed attempt backs
+// off exponentially; after WIFI_FALLBACK_ATTEMPTS failures in a row the
+// access point comes up alongside, so the skate stays reachable while the
+// retries go on.
+#define WIFI_CONNECT_TIMEOUT 15000  // ms for one attempt
+#define WIFI_BACKOFF_MIN 1000
+#define WIFI_BACKOFF_MAX 60000
+#define WIFI_FALLBACK_ATTEMPTS 4
+#define WIFI_TASK_PERIOD_MS 50
+
+enum WifiState
+{
+  WifiAccessPoint,   // access point mode, nothing to do
+  WifiConnecting,    // station attempt in progress
+  WifiConnected,
+  WifiBackoff,       // waiting before the next attempt
+};
+
+typedef struct
+{
+  uint32_t attempts;
+  uint32_t connects;
+  uint32_t disconnects;         // lost an established connection
+  uint32_t fallbacks;           // times the access point came up as a fallback
+  uint32_t lastConnectMillis;   // attempt start to IP address, latest connect
+  uint32_t totalConnectMillis;
+  uint8_t lastDisconnectReason; // wifi_err_reason_t
+} WifiStats;
+
+TaskHandle_t networkTaskHandle = NULL;
+WifiState wifiState = WifiAccessPoint;
+WifiStats wifiStats;
+bool wifiFallbackAccessPoint = false;
+uint8_t wifiFailures = 0;        // failed attempts in a row, saturates at 255
+unsigned long wifiStateMillis;   // when wifiState was entered
+uint32_t wifiBackoffMillis;
+int8_t wifiRunningStationMode = -1;   // stationMode setupWifi() last applied
+
+// set from the WiFi event task and web handlers, consumed by handleWifi()
+volatile bool wifiGotAddress = false;
+volatile bool wifiLostConnection = false;
+volatile bool wifiModeChangeRequested = false;
+
+void onWifiEvent(WiFiEvent_t event, WiFiEventInfo_t info)
+{
+  if (event == SYSTEM_EVENT_STA_GOT_IP)
+  {
+    wifiGotAddress = true;
+  }
+  else if (event == SYSTEM_EVENT_STA_DISCONNECTED)
+  {
+    wifiStats.lastDisconnectReason = info.disconnected.reason;
+    wifiLostConnection = true;
+  }
+}
+
+void wifiModeChanged()
+{
+  wifiModeChangeRequested = true;
+}
+
+void startAccessPoint()
+{
+  const char* hostnameChar = WIFI_NAME;
+
+  WiFi.softAP(hostnameChar, apPassword);
+  uint8_t val = 0;
+  tcpip_adapter_dhcps_option(TCPIP_ADAPTER_OP_SET, TCPIP_ADAPTER_ROUTER_SOLICITATION_ADDRESS, &val, sizeof(dhcps_offer_t));
+  LOG_INFO("Connect to Wi-Fi access point: %s", hostnameChar);
+  LOG_INFO("and open http://192.168.4.1 in your browser");
+  #ifdef ESP32
+  LOG_INFO("soft AP IP: %s", WiFi.softAPIP().toString().c_str());
+  #endif
+}
+
+void setWifiState(WifiState state)
+{
+  wifiState = state;
+  wifiStateMillis = millis();
+}
+
+void startStationAttempt()
+{
+  wifiGotAddress = false;
+  wifiLostConnection = false;
+  wifiStats.attempts++;
+  LOG_INFO("Connecting to %s", ssid);
+  WiFi.begin(ssid, password);
+  setWifiState(WifiConnecting);
+}
 
 void setupWifi()
 {
+  static bool eventsRegistered = false;
 
   const char* hostnameChar = WIFI_NAME;
 
@@ -41,22 +136,116 @@ void setupWifi()
   WiFi.disconnect();
   WiFi.mode(WIFI_OFF);
 
-  if (apMode)
+  if (!eventsRegistered)
+  {
+    WiFi.onEvent(onWifiEvent);
+    eventsRegistered = true;
+  }
+  wifiFallbackAccessPoint = false;
+  wifiFailures = 0;
+
+  if (!stationMode)
   {
     WiFi.mode(WIFI_AP);
-    WiFi.softAP(hostnameChar, apPassword);
-    uint8_t val = 0;
-    tcpip_adapter_dhcps_option(TCPIP_ADAPTER_OP_SET, TCPIP_ADAPTER_ROUTER_SOLICITATION_ADDRESS, &val, sizeof(dhcps_offer_t));
-    Serial.printf("Connect to Wi-Fi access point: %s\n", hostnameChar);
-    Serial.println("and open http://192.168.4.1 in your browser");
-    #ifdef ESP32
-    Serial.printf("soft AP IP: %s\n", WiFi.gatewayIP());
-    #endif
+    startAccessPoint();
+    setWifiState(WifiAccessPoint);
   }
   else
   {
     WiFi.mode(WIFI_STA);
-    Serial.printf("Connecting to %s\n", ssid);
-    WiFi.begin(ssid, password);
+    // reconnects are handled here, with backoff
+    WiFi.setAutoReconnect(false);
+    startStationAttempt();
+  }
+
+  // loading settings at boot runs wifiModeChanged() too, that's covered now
+  wifiRunningStationMode = stationMode;
+  wifiModeChangeRequested = false;
+}
+
+// Called every WIFI_TASK_PERIOD_MS from the network task
+void handleWifi()
+{
+  if (wifiModeChangeRequested)
+  {
+    wifiModeChangeRequested = false;
+    if (stationMode != wifiRunningStationMode)
+    {
+      LOG_INFO("Switching to %s mode", stationMode ? "station" : "access point");
+      setupWifi();
+      return;
+    }
+  }
+
+  unsigned long now = millis();
+  switch (wifiState)
+  {
+  case WifiAccessPoint:
+    break;
+
+  case WifiConnecting:
+    if (wifiGotAddress)
+    {
+      wifiStats.connects++;
+      wifiStats.lastConnectMillis = now - wifiStateMillis;
+      wifiStats.totalConnectMillis += wifiStats.lastConnectMillis;
+      wifiFailures = 0;
+      LOG_INFO("WiFi connected in %lu ms, IP address: %s", (unsigned long)wifiStats.lastConnectMillis,
+               WiFi.localIP().toString().c_str());
+      if (wifiFallbackAccessPoint)
+      {
+        LOG_INFO("Closing the fallback access point");
+        WiFi.softAPdisconnect(true);
+        WiFi.mode(WIFI_STA);
+        wifiFallbackAccessPoint = false;
+      }
+      // turn off the board's LED when connected to wifi
+      digitalWrite(LED_BUILTIN, LOW);
+      setWifiState(WifiConnected);
+    }
+    else if (now - wifiStateMillis > WIFI_CONNECT_TIMEOUT)
+    {
+      // disconnect events during an attempt only record the reason; the
+      // attempt ends on an address or the timeout
+      if (wifiFailures < 255)
+        wifiFailures++;
+      wifiBackoffMillis = min((uint32_t)WIFI_BACKOFF_MIN << min((uint8_t)(wifiFailures - 1), (uint8_t)6), (uint32_t)WIFI_BACKOFF_MAX);
+      LOG_WARN("WiFi attempt %u failed (reason %u), retrying in %lu ms", wifiFailures,
+               wifiStats.lastDisconnectReason, (unsigned long)wifiBackoffMillis);
+      if (wifiFailures >= WIFI_FALLBACK_ATTEMPTS && !wifiFallbackAccessPoint)
+      {
+        wifiStats.fallbacks++;
+        wifiFallbackAccessPoint = true;
+        WiFi.mode(WIFI_AP_STA);
+        startAccessPoint();
+      }
+      digitalWrite(LED_BUILTIN, LOW);
+      setWifiState(WifiBackoff);
+    }
+    else
+    {
+      // blink the board's LED while connecting to wifi
+      EVERY_N_MILLIS(125)
+      {
+        digitalWrite(LED_BUILTIN, !digitalRead(LED_BUILTIN));
+      }
+    }
+    break;
+
+  case WifiConnected:
+    if (wifiLostConnection)
+    {
+      wifiStats.disconnects++;
+      LOG_WARN("WiFi connection lost (reason %u)", wifiStats.lastDisconnectReason);
+      startStationAttempt();
+    }
+    break;
+
+  case WifiBackoff:
+    if (now - wifiStateMillis >= wifiBackoffMillis)
+    {
+      startStationAttempt();
+    }
+    break;
   }
 }
@@ -0,0 +1,428 @@
+/*
+   ESP32 FastLED WebServer: https://github.com/jasoncoon/esp32-fastled-webserver
+   Copyright (C) 2017 Jason Coon
+
+   Built upon the amazing FastLED work of Daniel Garcia and Mark Kriegsman:
+   https://github.com/FastLED/FastLED
+
+   ESP32 support provided by the hard work of Sam Guyer:
+   https://github.com/samguyer/FastLED
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// On-device benchmarks, run with a strip attached:
+//   pio test -e test_strip -e test_strip_depth16
+// The two envs differ only in RENDER_DEPTH_16, so one run covers both depths.
+// Each case renders BENCH_FRAMES frames into its own buffers, so the strip
+// length of the env doesn't matter, and prints the time per frame. Where
+// the code replaced something, the case checks it against the old version.
+
+#include <unity.h>
+
+// big enough for the 2000 led case on any env
+#define TWINKLE_PIXELS 2000
+
+#include "../../src/main.cpp"
+
+#define BENCH_FRAMES 100
+#define BENCH_LEDS_MAX 2000
+#define BENCH_FRAME_MILLIS 8 // 120 fps
+
+CRGB benchLeds[BENCH_LEDS_MAX];
+CRGB referenceLeds[BENCH_LEDS_MAX];
+CRGB incomingLeds[BENCH_LEDS_MAX];
+RenderPixel benchOutput[BENCH_LEDS_MAX];
+CRGB benchDevice[SKATE_LED_LENGTH];
+PaletteLUT benchPalette;
+
+void reportFrameMicros(const char *name, uint16_t count, uint32_t micros)
+{
+  char message[96];
+  snprintf(message, sizeof(message), "%s, %u leds: %lu us/frame", name, count, (unsigned long)(micros / BENCH_FRAMES));
+  TEST_MESSAGE(message);
+}
+
+// drawTwinkles() as it was before the per-pixel cache and the palette LUTs:
+// each pixel's clock and salt come back out of the PRNG, its slow cycle is
+// rehashed and its color looked up in the CRGBPalette16, every frame
+CRGB computeOneTwinkleReference(const CRGBPalette16 &palette, uint32_t ms, uint8_t salt)
+{
+  uint16_t ticks = ms >> (8 - twinkleSpeed);
+  uint8_t fastcycle8 = ticks;
+  uint16_t slowcycle16 = (ticks >> 8) + salt;
+  slowcycle16 += sin8(slowcycle16);
+  slowcycle16 = (slowcycle16 * 2053) + 1384;
+  uint8_t slowcycle8 = (slowcycle16 & 0xFF) + (slowcycle16 >> 8);
+
+  uint8_t bright = 0;
+  if (((slowcycle8 & 0x0E) / 2) < twinkleDensity)
+    bright = attackDecayWave8(fastcycle8);
+
+  uint8_t hue = slowcycle8 - salt;
+  CRGB c;
+  if (bright > 0)
+  {
+    c = ColorFromPalette(palette, hue, bright, NOBLEND);
+    if (COOL_LIKE_INCANDESCENT == 1)
+      coolLikeIncandescent(c, fastcycle8);
+  }
+  else
+  {
+    c = CRGB::Black;
+  }
+  return c;
+}
+
+void drawTwinklesReference(CRGB *leds, uint16_t count, const CRGBPalette16 &palette, uint32_t clock32)
+{
+  uint16_t PRNG16 = 11337;
+  CRGB bg = gBackgroundColor;
+  uint8_t backgroundBrightness = bg.getAverageLight();
+
+  for (uint16_t i = 0; i < count; i++)
+  {
+    PRNG16 = (uint16_t)(PRNG16 * 2053) + 1384;
+    uint16_t myclockoffset16 = PRNG16;
+    PRNG16 = (uint16_t)(PRNG16 * 2053) + 1384;
+    uint8_t myspeedmultiplierQ5_3 = ((((PRNG16 & 0xFF) >> 4) + (PRNG16 & 0x0F)) & 0x0F) + 0x08;
+    uint32_t myclock30 = (uint32_t)((clock32 * myspeedmultiplierQ5_3) >> 3) + myclockoffset16;
+    uint8_t myunique8 = PRNG16 >> 8;
+
+    CRGB c = computeOneTwinkleReference(palette, myclock30, myunique8);
+
+    uint8_t cbright = c.getAverageLight();
+    int16_t deltabright = cbright - backgroundBrightness;
+    if (deltabright >= 32 || (!bg))
+      leds[i] = c;
+    else if (deltabright > 0)
+      leds[i] = blend(bg, c, deltabright * 8);
+    else
+      leds[i] = bg;
+  }
+}
+
+void testTwinklesMatchReference()
+{
+  for (uint8_t speed = 4; speed <= 6; speed += 2)
+  {
+    twinkleSpeed = speed;
+    // odd steps so slow cycle epochs roll over part way through the strip
+    for (uint32_t clock = 0; clock < 30000; clock += 97)
+    {
+      drawTwinklesAt(benchLeds, BENCH_LEDS_MAX, benchPalette, clock);
+      drawTwinklesReference(referenceLeds, BENCH_LEDS_MAX, benchPalette.source, clock);
+      TEST_ASSERT_EQUAL_MEMORY(referenceLeds, benchLeds, sizeof(benchLeds));
+    }
+  }
+  twinkleSpeed = 4;
+}
+
+void benchmarkTwinkles(uint16_t count)
+{
+  uint32_t clock = 0;
+  uint32_t start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    drawTwinklesReference(referenceLeds, count, benchPalette.source, clock += BENCH_FRAME_MILLIS);
+  }
+  uint32_t reference = micros() - start;
+
+  clock = 0;
+  start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    drawTwinklesAt(benchLeds, count, benchPalette, clock += BENCH_FRAME_MILLIS);
+  }
+  uint32_t cached = micros() - start;
+
+  reportFrameMicros("twinkles, uncached", count, reference);
+  reportFrameMicros("twinkles, cached", count, cached);
+  TEST_ASSERT_LESS_THAN_UINT32(reference, cached);
+}
+
+void testTwinkles285() { benchmarkTwinkles(285); }
+void testTwinkles2000() { benchmarkTwinkles(2000); }
+
+// Pride and ColorWaves as they were before WaveField, with sin16 and 32-bit
+// squaring per pixel
+struct WaveReference
+{
+  uint16_t sPseudotime = 0;
+  uint16_t sHue16 = 0;
+};
+
+void renderPrideReference(WaveReference &state, const PatternFrame &frame)
+{
+  CRGB *leds = frame.leds;
+  uint16_t count = frame.count;
+
+  uint8_t sat8 = beatsin88(87, 220, 250);
+  uint8_t brightdepth = beatsin88(341, 96, 224);
+  uint16_t brightnessthetainc16 = beatsin88(203, (25 * 256), (40 * 256));
+  uint8_t msmultiplier = beatsin88(147, 23, 60);
+
+  uint16_t hue16 = state.sHue16;
+  uint16_t hueinc16 = beatsin88(113, 1, 3000);
+
+  uint16_t deltams = frame.dt;
+  state.sPseudotime += deltams * msmultiplier;
+  state.sHue16 += deltams * beatsin88(400, 5, 9);
+  uint16_t brightnesstheta16 = state.sPseudotime;
+
+  for (uint16_t i = 0; i < count; i++)
+  {
+    hue16 += hueinc16;
+    uint8_t hue8 = hue16 / 256;
+
+    brightnesstheta16 += brightnessthetainc16;
+    uint16_t b16 = sin16(brightnesstheta16) + 32768;
+
+    uint16_t bri16 = (uint32_t)((uint32_t)b16 * (uint32_t)b16) / 65536;
+    uint8_t bri8 = (uint32_t)(((uint32_t)bri16) * brightdepth) / 65536;
+    bri8 += (255 - brightdepth);
+
+    CRGB newcolor = CHSV(hue8, sat8, bri8);
+    nblend(leds[(count - 1) - i], newcolor, 64);
+  }
+}
+
+void renderColorWavesReference(WaveReference &state, const PatternFrame &frame)
+{
+  CRGB *ledarray = frame.leds;
+  uint16_t numleds = frame.count;
+  const PaletteLUT &palette = *frame.blendedPalette;
+
+  uint8_t brightdepth = beatsin88(341, 96, 224);
+  uint16_t brightnessthetainc16 = beatsin88(203, (25 * 256), (40 * 256));
+  uint8_t msmultiplier = beatsin88(147, 23, 60);
+
+  uint16_t hue16 = state.sHue16;
+  uint16_t hueinc16 = beatsin88(113, 300, 1500);
+
+  uint16_t deltams = frame.dt;
+  state.sPseudotime += deltams * msmultiplier;
+  state.sHue16 += deltams * beatsin88(400, 5, 9);
+  uint16_t brightnesstheta16 = state.sPseudotime;
+
+  for (uint16_t i = 0; i < numleds; i++)
+  {
+    hue16 += hueinc16;
+    uint8_t hue8;
+    uint16_t h16_128 = hue16 >> 7;
+    if (h16_128 & 0x100)
+      hue8 = 255 - (h16_128 >> 1);
+    else
+      hue8 = h16_128 >> 1;
+
+    brightnesstheta16 += brightnessthetainc16;
+    uint16_t b16 = sin16(brightnesstheta16) + 32768;
+
+    uint16_t bri16 = (uint32_t)((uint32_t)b16 * (uint32_t)b16) / 65536;
+    uint8_t bri8 = (uint32_t)(((uint32_t)bri16) * brightdepth) / 65536;
+    bri8 += (255 - brightdepth);
+
+    CRGB newcolor = paletteColor(palette, scale8(hue8, 240), bri8);
+    nblend(ledarray[(numleds - 1) - i], newcolor, 128);
+  }
+}
+
+typedef void (*WaveReferenceRender)(WaveReference &state, const PatternFrame &frame);
+
+PatternFrame benchFrame(CRGB *leds, uint16_t count)
+{
+  PatternFrame frame = patternFrame(leds, count);
+  frame.dt = BENCH_FRAME_MILLIS;
+  frame.palette = &benchPalette;
+  frame.blendedPalette = &benchPalette;
+  return frame;
+}
+
+// Every frame starts both versions from the reference's previous frame, at
+// the same instant, and every channel has to come out within 1.
+void checkWaveField(Pattern &pattern, WaveReferenceRender reference, uint16_t count)
+{
+  WaveReference state;
+  pattern.reset();
+  fill_solid(referenceLeds, BENCH_LEDS_MAX, CRGB::Black);
+  timebaseFrozen = true;
+  for (uint16_t frame = 0; frame < 1000; frame++)
+  {
+    frozenMillis = frame * 37;
+    memcpy(benchLeds, referenceLeds, count * sizeof(CRGB));
+    pattern.render(benchFrame(benchLeds, count));
+    reference(state, benchFrame(referenceLeds, count));
+    for (uint16_t i = 0; i < count; i++)
+    {
+      for (uint8_t channel = 0; channel < 3; channel++)
+      {
+        TEST_ASSERT_INT_WITHIN(1, referenceLeds[i].raw[channel], benchLeds[i].raw[channel]);
+      }
+    }
+  }
+  timebaseFrozen = false;
+}
+
+void benchmarkWaveField(const char *name, Pattern &pattern, WaveReferenceRender reference, uint16_t count)
+{
+  WaveReference state;
+  uint32_t start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    reference(state, benchFrame(referenceLeds, count));
+  }
+  uint32_t before = micros() - start;
+
+  pattern.reset();
+  start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    pattern.render(benchFrame(benchLeds, count));
+  }
+  uint32_t after = micros() - start;
+
+  char message[48];
+  snprintf(message, sizeof(message), "%s, sin16", name);
+  reportFrameMicros(message, count, before);
+  snprintf(message, sizeof(message), "%s, WaveField", name);
+  reportFrameMicros(message, count, after);
+  TEST_ASSERT_LESS_THAN_UINT32(before, after);
+}
+
+void testWaveField()
+{
+  Pride pride;
+  ColorWaves colorWaves;
+  checkWaveField(pride, renderPrideReference, 285);
+  checkWaveField(colorWaves, renderColorWavesReference, 285);
+
+  const uint16_t counts[] = {285, 2000};
+  for (uint8_t c = 0; c < ARRAY_SIZE(counts); c++)
+  {
+    benchmarkWaveField("pride", pride, renderPrideReference, counts[c]);
+    benchmarkWaveField("colorwaves", colorWaves, renderColorWavesReference, counts[c]);
+  }
+}
+
+// A frame with one pattern against one mid transition, with twinkles
+// standing in for both patterns. The transition has to fit a 120 fps frame
+// at 285 leds.
+void benchmarkTransition(uint8_t type, uint16_t count)
+{
+  uint32_t clock = 0;
+  uint32_t start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    drawTwinklesAt(benchLeds, count, benchPalette, clock += BENCH_FRAME_MILLIS);
+    for (uint16_t i = 0; i < count; i++)
+    {
+      storePixel(benchOutput[i], benchLeds[i]);
+    }
+  }
+  uint32_t single = micros() - start;
+
+  clock = 0;
+  start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    clock += BENCH_FRAME_MILLIS;
+    drawTwinklesAt(benchLeds, count, benchPalette, clock);
+    drawTwinklesAt(incomingLeds, count, benchPalette, clock + 1000);
+    blendTransition(benchLeds, incomingLeds, benchOutput, count, type, (frame * 255) / BENCH_FRAMES);
+  }
+  uint32_t transition = micros() - start;
+
+  char name[48];
+  reportFrameMicros("one pattern", count, single);
+  snprintf(name, sizeof(name), "%s transition", transitionNames[type]);
+  reportFrameMicros(name, count, transition);
+
+  char message[96];
+  uint32_t overhead = transition > single ? transition - single : 0;
+  snprintf(message, sizeof(message), "%s transition overhead, %u leds: %lu us/frame, %lu%% of one pattern",
+           transitionNames[type], count, (unsigned long)(overhead / BENCH_FRAMES), (unsigned long)(overhead * 100 / max(single, (uint32_t)1)));
+  TEST_MESSAGE(message);
+  if (count <= 285)
+    TEST_ASSERT_LESS_THAN_UINT32(1000000 / 120, transition / BENCH_FRAMES);
+}
+
+void testTransitions()
+{
+  for (uint8_t type = CrossfadeTransition; type < transitionCount; type++)
+  {
+    benchmarkTransition(type, 285);
+    benchmarkTransition(type, 2000);
+  }
+}
+
+// Cost of the render depth this env is built with; test_strip_depth16
+// reports the 16-bit side of the comparison. Segment brightness
+// stands in for the blend stages. The output stage always writes
+// SKATE_LED_LENGTH pixels.
+void testRenderDepth()
+{
+#ifdef RENDER_DEPTH_16
+  const char *depth = "16-bit";
+#else
+  const char *depth = "8-bit";
+#endif
+  char message[112];
+  snprintf(message, sizeof(message), "%s: leds[] %u B at 285 leds, %u B at 2000, output curves %u B", depth,
+           (unsigned)(285 * sizeof(RenderPixel)), (unsigned)(2000 * sizeof(RenderPixel)), (unsigned)sizeof(outputCurves));
+  TEST_MESSAGE(message);
+
+  const uint16_t counts[] = {285, 2000};
+  for (uint8_t c = 0; c < ARRAY_SIZE(counts); c++)
+  {
+    uint16_t count = counts[c];
+    drawTwinklesAt(benchLeds, count, benchPalette, 0);
+    uint32_t start = micros();
+    for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+    {
+      for (uint16_t i = 0; i < count; i++)
+      {
+        storeScaled(benchOutput[i], benchLeds[i], frame);
+      }
+    }
+    snprintf(message, sizeof(message), "%s blend stage", depth);
+    reportFrameMicros(message, count, micros() - start);
+  }
+
+  uint32_t start = micros();
+  for (uint16_t frame = 0; frame < BENCH_FRAMES; frame++)
+  {
+    writeOutput(LocalOutput, benchOutput, benchDevice);
+  }
+  snprintf(message, sizeof(message), "%s output stage", depth);
+  reportFrameMicros(message, SKATE_LED_LENGTH, micros() - start);
+}
+
+void setup()
+{
+  delay(2000); // time for the serial monitor to attach
+  buildPaletteLUT(benchPalette, getPalette(0));
+
+  UNITY_BEGIN();
+  RUN_TEST(testTwinklesMatchReference);
+  RUN_TEST(testTwinkles285);
+  RUN_TEST(testTwinkles2000);
+  RUN_TEST(testWaveField);
+  RUN_TEST(testTransitions);
+  RUN_TEST(testRenderDepth);
+  UNITY_END();
+}
+
+void loop()
+{
+}